@@ -0,0 +1,106 @@
+#!/bin/sh
+# Benchmark driver for smallsh: runs the shell against generated scripts
+# and reports throughput and per-command latency for each case.
+#
+# usage: bench.sh [path/to/smallsh]
+#
+#   BENCH_N     commands per case (default 2000)
+#   BENCH_CASES cases to run (default: fork expand longline background
+#               redirect startup)
+#
+# Latencies come from the shell's own -t accounting: one "Timing:" line
+# per command, its wall time since the line was parsed. Commands/sec is
+# the case's command count over the wall time of the whole run,
+# including startup and reading the script.
+#
+# The startup case instead starts the shell N times in a row on a
+# one-line script; its rate is starts/sec and its p50 column the mean
+# time per start, which includes sh's own fork and exec.
+
+set -eu
+
+SMALLSH=${1:-release/smallsh}
+N=${BENCH_N:-2000}
+CASES=${BENCH_CASES:-"fork expand longline background redirect startup"}
+
+if [ ! -x "$SMALLSH" ]; then
+  echo "bench: $SMALLSH is not executable (run make release)" >&2
+  exit 1
+fi
+
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/smallsh-bench.XXXXXX")
+trap 'rm -rf "$TMP"' EXIT INT TERM
+
+# Monotonic-enough wall clock in seconds, with nanoseconds
+now() {
+  date +%s.%N
+}
+
+# Writes the script for one case to $TMP/$1.sh
+generate() {
+  awk -v n="$N" -v kind="$1" -v tmp="$TMP" 'BEGIN {
+    words = ""
+    for (w = 0; w < 500; w++) words = words " word" w
+    for (i = 0; i < n; i++) {
+      if (kind == "fork") {
+        print "/bin/true"
+      } else if (kind == "expand") {
+        print "echo $$ $? ${HOME} ${PATH} $! x${USER}y > /dev/null"
+      } else if (kind == "longline") {
+        print "echo" words " > /dev/null"
+      } else if (kind == "background") {
+        print "/bin/true &"
+      } else if (kind == "redirect") {
+        if (i % 2) print "/bin/cat < " tmp "/in > " tmp "/out"
+        else print "/bin/cat < " tmp "/in >> " tmp "/out"
+      }
+    }
+    if (kind == "background") print "wait"
+  }' > "$TMP/$1.sh"
+}
+
+# Prints "name commands cmds/sec p50 p99" for one case
+run_case() {
+  generate "$1"
+  start=$(now)
+  "$SMALLSH" -t "$TMP/$1.sh" > /dev/null 2> "$TMP/$1.err"
+  end=$(now)
+
+  grep '^Timing: ' "$TMP/$1.err" | awk '{ sub(/s$/, "", $3); print $3 }' \
+    | sort -n > "$TMP/$1.lat"
+  awk -v name="$1" -v start="$start" -v end="$end" '
+    { lat[NR] = $1 }
+    END {
+      if (NR == 0) { printf "%-12s no timing lines\n", name; exit 1 }
+      p50 = lat[int((NR - 1) * 0.50) + 1]
+      p99 = lat[int((NR - 1) * 0.99) + 1]
+      printf "%-12s %8d %12.0f %10.1f %10.1f\n", name, NR,
+             NR / (end - start), p50 * 1e6, p99 * 1e6
+    }' "$TMP/$1.lat"
+}
+
+# Prints "startup starts starts/sec mean -"
+run_startup() {
+  printf 'true\n' > "$TMP/startup.sh"
+  i=0
+  start=$(now)
+  while [ "$i" -lt "$N" ]; do
+    "$SMALLSH" "$TMP/startup.sh"
+    i=$((i + 1))
+  done
+  end=$(now)
+  awk -v n="$N" -v start="$start" -v end="$end" 'BEGIN {
+    printf "%-12s %8d %12.0f %10.1f %10s\n", "startup", n,
+           n / (end - start), (end - start) / n * 1e6, "-"
+  }'
+}
+
+printf 'x\n' > "$TMP/in"
+printf '%-12s %8s %12s %10s %10s\n' case cmds cmds/sec p50_us p99_us
+for c in $CASES; do
+  if [ "$c" = startup ]; then
+    run_startup
+  else
+    run_case "$c"
+  fi
+done
@@ -0,0 +1,145 @@
+/******************************************************************************
+** Program:     Small Shell
+** Description: Microbenchmark for the parsing kernels in parse.c. Lexes a
+**              corpus of command lines over and over, once leaving the
+**              expansions for later and once expanding them, and reports
+**              throughput in MB/s and the time per line.
+**
+**              usage: lexbench [file]
+**
+**              With no file, a built-in mix of short, expanding, escaped
+**              and 500-word lines is used. LEXBENCH_MB sets how much
+**              input each case runs over (default 256).
+******************************************************************************/
+//INCLUDES/////////////////////////////////////////////////////////////////////
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+#include <string.h>
+#include <time.h>
+
+#include "../parse.h"
+
+//FUNCTIONS////////////////////////////////////////////////////////////////////
+
+/* Stands in for the shell's parameters */
+char const *
+bench_lookup(struct parse_ctx *ctx, char c, char const *name, size_t len) {
+  if (c == '{') return len == 4 ? "/usr/local/bin:/usr/bin:/bin" : "value";
+  return "12345";
+}
+
+/* Reads a whole file, or builds the default corpus, NUL-terminated */
+char *
+load_corpus(char const *path, size_t *size) {
+  if (path) {
+    FILE *f = fopen(path, "r");
+    if (!f) err(1, "%s", path);
+    char *data = NULL;
+    size_t cap = 0;
+    *size = 0;
+    for (;;) {
+      if (cap - *size < 65536) {
+        cap = cap ? cap * 2 : 65536;
+        data = realloc(data, cap + 1);
+        if (!data) err(1, "realloc");
+      }
+      size_t n = fread(data + *size, 1, cap - *size, f);
+      if (n == 0) break;
+      *size += n;
+    }
+    fclose(f);
+    data[*size] = '\0';
+    return data;
+  }
+
+  static char const *const lines[] = {
+    "ls -la /tmp",
+    "cat < in.txt | grep -v pattern | sort -u | wc -l > out.txt &",
+    "echo $$ $? ${HOME} ${PATH} $! x${USER}y > /dev/null",
+    "printf %s\\n a\\ b c\\ d e\\ f",
+    "echo [$(date +%s)] done",
+    "cmd >> log.txt << EOF",
+  };
+  size_t n_lines = sizeof lines / sizeof *lines;
+  char longline[8192] = "echo";
+  for (int i = 0; i < 500; i++) {
+    snprintf(longline + strlen(longline), sizeof longline - strlen(longline),
+             " word%d", i);
+  }
+
+  size_t cap = 1 << 20;
+  char *data = malloc(cap + sizeof longline + 256);
+  if (!data) err(1, "malloc");
+  *size = 0;
+  for (size_t i = 0; *size < cap; i++) {
+    char const *line = i % (n_lines + 1) == n_lines ? longline
+                     : lines[i % (n_lines + 1)];
+    size_t len = strlen(line);
+    memcpy(data + *size, line, len);
+    *size += len;
+    data[(*size)++] = '\n';
+  }
+  data[*size] = '\0';
+  return data;
+}
+
+double
+now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Lexes every line of the corpus, from a scratch copy since the lexer
+ * works in place, until total bytes have gone through; prints one row.
+ */
+void
+run_case(char const *name, char const *corpus, size_t size, bool late,
+         size_t total) {
+  struct arena arena = {0};
+  struct parse_ctx ctx = { .arena = &arena, .lookup = bench_lookup };
+  char *scratch = malloc(size + 1);
+  if (!scratch) err(1, "malloc");
+
+  size_t bytes = 0, n_lines = 0, n_tokens = 0;
+  double start = now();
+  while (bytes < total) {
+    memcpy(scratch, corpus, size + 1);
+    for (char *line = scratch; *line;) {
+      char *nl = strchr(line, '\n');
+      if (nl) *nl = '\0';
+      n_tokens += lex(&ctx, line, late);
+      arena_reset(&arena);
+      ++n_lines;
+      line = nl ? nl + 1 : line + strlen(line);
+    }
+    bytes += size;
+  }
+  double secs = now() - start;
+
+  printf("%-12s %10.1f %10.1f %12zu\n", name, bytes / secs / 1e6,
+         secs / n_lines * 1e9, n_tokens / n_lines);
+  free(scratch);
+  free(ctx.words);
+  arena_reset(&arena);
+  free(arena.head);
+}
+
+int
+main(int argc, char *argv[]) {
+  if (argc > 2) errx(1, "usage: %s [file]", argv[0]);
+  size_t size;
+  char *corpus = load_corpus(argc == 2 ? argv[1] : NULL, &size);
+  if (size == 0) errx(1, "empty corpus");
+  char const *mb = getenv("LEXBENCH_MB");
+  size_t total = (mb ? strtoul(mb, NULL, 10) : 256) << 20;
+
+  printf("%-12s %10s %10s %12s\n", "case", "MB/s", "ns/line", "tokens/line");
+  run_case("lex", corpus, size, true, total);
+  run_case("lex+expand", corpus, size, false, total);
+  free(corpus);
+  return 0;
+}
@@ -0,0 +1,116 @@
+/******************************************************************************
+** Program:     Small Shell
+** Description: libFuzzer target for the parsing kernels in parse.c. Each
+**              input is split into lines as the shell would read them, and
+**              every line is lexed once with expansions done on the spot
+**              and once flagged for later, after which the flagged words
+**              are expanded. $( ... ) substitutions recurse into the lexer
+**              with a context of their own, the way the shell runs them.
+**
+**              Built with -DFUZZ_MAIN, it instead replays the files named
+**              on the command line, for compilers without libFuzzer.
+******************************************************************************/
+//INCLUDES/////////////////////////////////////////////////////////////////////
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <err.h>
+#include <string.h>
+
+#include "../parse.h"
+
+//FUNCTIONS////////////////////////////////////////////////////////////////////
+
+char const *
+fuzz_lookup(struct parse_ctx *ctx, char c, char const *name, size_t len) {
+  if (c == '{') return len % 2 ? NULL : "${x}$$";
+  return c == '?' ? "" : "42";
+}
+
+/* Lexes the command into a context of its own, sharing the arena, and
+ * appends the words it finds, space separated, to the outer string.
+ */
+void
+fuzz_subst(struct parse_ctx *ctx, char const *text, size_t len) {
+  char *line = arena_alloc(ctx->arena, len + 1);
+  memcpy(line, text, len);
+  line[len] = '\0';
+
+  struct parse_ctx inner = *ctx;
+  inner.words = NULL;
+  inner.words_cap = 0;
+  size_t n = lex(&inner, line, false);
+  for (size_t i = 0; i < n; ++i) {
+    if (i > 0) build_str(ctx, " ", NULL);
+    build_str(ctx, inner.words[i].text, NULL);
+  }
+  free(inner.words);
+}
+
+int
+LLVMFuzzerTestOneInput(uint8_t const *data, size_t size) {
+  static struct arena arena;
+  static struct parse_ctx ctx = {
+    .arena = &arena, .lookup = fuzz_lookup, .subst = fuzz_subst
+  };
+
+  char *copy = malloc(size + 1);
+  if (!copy) err(1, "malloc");
+  char *late = malloc(size + 1);
+  if (!late) err(1, "malloc");
+
+  for (size_t begin = 0; begin < size;) {
+    uint8_t const *nl = memchr(data + begin, '\n', size - begin);
+    size_t len = nl ? (size_t) (nl - data) - begin : size - begin;
+    memcpy(copy, data + begin, len);
+    copy[len] = '\0';
+    memcpy(late, copy, len + 1);
+    begin += len + 1;
+
+    size_t n = lex(&ctx, copy, false);
+    for (size_t i = 0; i < n; ++i) {
+      if (ctx.words[i].expand) abort();
+      (void) strlen(ctx.words[i].text);
+    }
+    n = lex(&ctx, late, true);
+    for (size_t i = 0; i < n; ++i) {
+      struct token *tok = &ctx.words[i];
+      if (tok->expand && tok->type != TOK_WORD) abort();
+      if (tok->expand) tok->text = expand(&ctx, tok->text);
+    }
+    arena_reset(&arena);
+  }
+
+  free(copy);
+  free(late);
+  return 0;
+}
+
+#ifdef FUZZ_MAIN
+int
+main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    FILE *f = fopen(argv[i], "r");
+    if (!f) err(1, "%s", argv[i]);
+    uint8_t *data = NULL;
+    size_t size = 0, cap = 0;
+    for (;;) {
+      if (cap == size) {
+        cap = cap ? cap * 2 : 4096;
+        data = realloc(data, cap);
+        if (!data) err(1, "realloc");
+      }
+      size_t n = fread(data + size, 1, cap - size, f);
+      if (n == 0) break;
+      size += n;
+    }
+    fclose(f);
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+  }
+  printf("replayed %d inputs\n", argc - 1);
+  return 0;
+}
+#endif
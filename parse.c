@@ -0,0 +1,343 @@
+/******************************************************************************
+** Program:     Small Shell
+** Description: Parsing kernels of smallsh, see parse.h. Nothing in here
+**              knows about the rest of the shell: parameter values and
+**              command substitution come from the parse_ctx hooks.
+******************************************************************************/
+//INCLUDES/////////////////////////////////////////////////////////////////////
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "parse.h"
+
+//MACROS///////////////////////////////////////////////////////////////////////
+
+/* What isspace() matches in the C locale, for strspn()/strcspn() */
+#define LEX_SPACE " \t\n\v\f\r"
+
+//ARENA////////////////////////////////////////////////////////////////////////
+
+/* Hands out size bytes from the arena, starting a new chunk when the
+ * current one is full. Memory stays valid until the next arena_reset().
+ */
+void *
+arena_alloc(struct arena *a, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if (!a->head || a->head->cap - a->head->len < size) {
+    size_t cap = a->head ? a->head->cap * 2 : ARENA_CHUNK;
+    if (cap < size) cap = size;
+    struct arena_chunk *chunk = malloc(sizeof *chunk + cap);
+    if (!chunk) err(1, "malloc");
+    chunk->prev = a->head;
+    chunk->len = 0;
+    chunk->cap = cap;
+    a->head = chunk;
+  }
+  void *ret = a->head->data + a->head->len;
+  a->head->len += size;
+  a->used += size;
+  if (a->used > a->high_water) a->high_water = a->used;
+  return ret;
+}
+
+/* Resizes an arena allocation. The most recent allocation is grown in
+ * place when the chunk has room; anything else is copied.
+ */
+void *
+arena_grow(struct arena *a, void *ptr, size_t old_size, size_t size) {
+  if (!ptr) return arena_alloc(a, size);
+  size_t old_round = (old_size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  size_t round = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  struct arena_chunk *head = a->head;
+  if ((char *) ptr + old_round == head->data + head->len
+  && head->cap - (head->len - old_round) >= round) {
+    head->len = head->len - old_round + round;
+    a->used = a->used - old_round + round;
+    if (a->used > a->high_water) a->high_water = a->used;
+    return ptr;
+  }
+  void *ret = arena_alloc(a, size);
+  memcpy(ret, ptr, old_size);
+  return ret;
+}
+
+/* Releases everything in the arena at once. If the last line spilled
+ * into several chunks, or into one bigger than ARENA_KEEP, they are
+ * replaced by one chunk big enough for the high-water mark, up to
+ * ARENA_KEEP, so later lines fit without further allocations but one
+ * huge line does not stay resident for the rest of the session.
+ */
+void
+arena_reset(struct arena *a) {
+  size_t keep = a->high_water < ARENA_KEEP ? a->high_water : ARENA_KEEP;
+  if (keep < ARENA_CHUNK) keep = ARENA_CHUNK;
+  if (a->head && (a->head->prev || a->head->cap > keep)) {
+    while (a->head) {
+      struct arena_chunk *prev = a->head->prev;
+      free(a->head);
+      a->head = prev;
+    }
+    struct arena_chunk *chunk = malloc(sizeof *chunk + keep);
+    if (!chunk) err(1, "malloc");
+    chunk->prev = NULL;
+    chunk->cap = keep;
+    a->head = chunk;
+  }
+  if (a->head) a->head->len = 0;
+  a->used = 0;
+}
+
+//LEXER////////////////////////////////////////////////////////////////////////
+
+/* Makes room for n tokens in ctx->words, doubling it as needed */
+void
+words_reserve(struct parse_ctx *ctx, size_t n) {
+  if (n <= ctx->words_cap) return;
+  size_t cap = ctx->words_cap ? ctx->words_cap : 64;
+  while (cap < n) cap *= 2;
+  void *tmp = realloc(ctx->words, sizeof *ctx->words * cap);
+  if (!tmp) err(1, "realloc");
+  ctx->words = tmp;
+  ctx->words_cap = cap;
+}
+
+/* Splits a line into typed tokens in a single pass. Words are delimited
+ * by whitespace, except inside $( ... ), '#' at the beginning of a word
+ * starts a comment, and a backslash escapes the next character. Escapes
+ * inside $( ... ) are kept for the substituted command.
+ *
+ * Words are unescaped and NUL-terminated in place, so they point straight
+ * into the line unless they contain a '$', in which case they are
+ * expanded into the arena as soon as they end. With late set they are
+ * only flagged, to be expanded when the line runs. A word that is made
+ * up only of &, |, <, >, >>, << or <<< (with no escapes) becomes an
+ * operator token.
+ *
+ * Runs of ordinary characters are skipped with strspn()/strcspn(), which
+ * the C library vectorizes, and only moved when an escape has shifted
+ * the word.
+ *
+ * Returns number of tokens parsed, and updates ctx->words.
+ */
+size_t
+lex(struct parse_ctx *ctx, char *line, bool late)
+{
+  size_t wind = 0;
+
+  char *c = line;
+  c += strspn(c, LEX_SPACE); /* discard leading space */
+
+  for (; *c;) {
+    if (wind == ctx->words_cap) words_reserve(ctx, wind + 1);
+    /* read a word */
+    if (*c == '#') break;
+    char *word = c;
+    char *w = c;
+    bool escaped = false;
+    bool dollar = false;
+    size_t depth = 0; // $( ... ) nesting, inside which spaces do not split
+    for (;;) {
+      size_t run = strcspn(c, depth > 0 ? "\\$)" : LEX_SPACE "\\$");
+      if (w != c) memmove(w, c, run);
+      w += run;
+      c += run;
+      if (!*c || (depth == 0 && isspace((unsigned char) *c))) break;
+
+      if (*c == '\\' && c[1]) {
+        if (depth > 0) *w++ = *c; // the substituted command unescapes
+        ++c;
+        escaped = true;
+      } else if (*c == '$' && c[1] == '(') {
+        ++depth;
+      } else if (*c == ')') {
+        --depth;
+      }
+      if (*c == '$') dollar = true;
+      *w++ = *c++;
+    }
+    if (*c) ++c; /* step over the delimiter before terminating the word */
+    *w = '\0';
+
+    struct token *tok = &ctx->words[wind++];
+    tok->type = TOK_WORD;
+    tok->text = word;
+    tok->expand = dollar && late;
+    if (dollar) {
+      if (!late) tok->text = expand(ctx, word);
+    } else if (!escaped && w - word <= 3) {
+      if (word[1] == '\0') {
+        if (word[0] == '&') tok->type = TOK_BG;
+        else if (word[0] == '|') tok->type = TOK_PIPE;
+        else if (word[0] == '<') tok->type = TOK_READ;
+        else if (word[0] == '>') tok->type = TOK_WRITE;
+      } else if (strcmp(word, ">>") == 0) {
+        tok->type = TOK_APPEND;
+      } else if (strcmp(word, "<<") == 0) {
+        tok->type = TOK_HEREDOC;
+      } else if (strcmp(word, "<<<") == 0) {
+        tok->type = TOK_HERESTR;
+      }
+    }
+    c += strspn(c, LEX_SPACE);
+  }
+  return wind;
+}
+
+//EXPANSION////////////////////////////////////////////////////////////////////
+
+/* Finds the ')' that closes a $( opened just before s, skipping nested
+ * ones and escaped characters. Returns NULL if there is none.
+ */
+char const *
+subst_end(char const *s) {
+  size_t depth = 1;
+  for (; *s; ++s) {
+    if (*s == '\\' && s[1]) ++s;
+    else if (*s == '$' && s[1] == '(') ++depth, ++s;
+    else if (*s == ')' && --depth == 0) return s;
+  }
+  return NULL;
+}
+
+/* Find next instance of a parameter within a word. Sets
+ * start and end pointers to the start and end of the parameter
+ * token, or to NULL if there is none.
+ */
+char
+param_scan(char const *word, char const **start, char const **end)
+{
+  char ret = 0;
+  *start = 0;
+  *end = 0;
+  for (char const *s = word; *s && !ret; ++s) {
+    s = strchr(s, '$');
+    if (!s) break;
+    switch (s[1]) {
+    case '$':
+    case '!':
+    case '?':
+      ret = s[1];
+      *start = s;
+      *end = s + 2;
+      break;
+    case '{':;
+      char *e = strchr(s + 2, '}');
+      if (e) {
+        ret = s[1];
+        *start = s;
+        *end = e + 1;
+      }
+      break;
+    case '(':;
+      char const *close = subst_end(s + 2);
+      if (close) {
+        ret = s[1];
+        *start = s;
+        *end = close + 1;
+      }
+      break;
+    }
+  }
+  return ret;
+}
+
+/* Simple string-builder function. Builds up a base
+ * string by appending supplied strings/character ranges
+ * to it. The base string lives at the top of the ctx's
+ * arena, so appending usually extends it in place; its
+ * room is doubled as needed and kept in ctx->cap.
+ */
+char *
+build_str(struct parse_ctx *ctx, char const *start, char const *end)
+{
+  char *base = ctx->base;
+
+  if (!start) {
+    /* Reset; new base string, return old one */
+    ctx->base = NULL;
+    ctx->len = 0;
+    ctx->cap = 0;
+    return base;
+  }
+  /* Append [start, end) to base string
+   * If end is NULL, append whole start string to base string.
+   * Returns a string in the arena, valid until it is reset.
+   */
+  size_t n = end ? end - start : strlen(start);
+  build_reserve(ctx, n);
+  memcpy(ctx->base + ctx->len, start, n);
+  ctx->len += n;
+  ctx->base[ctx->len] = '\0';
+  return ctx->base;
+}
+
+/* Makes room for n more bytes and a NUL at the end of the string being
+ * built, at least doubling its room when it has to grow.
+ */
+void
+build_reserve(struct parse_ctx *ctx, size_t n)
+{
+  size_t need = ctx->len + n + 1;
+  if (need <= ctx->cap) return;
+  size_t cap = ctx->cap * 2;
+  if (cap < need) cap = need;
+  ctx->base = arena_grow(ctx->arena, ctx->base, ctx->cap, cap);
+  ctx->cap = cap;
+}
+
+/* Appends everything read from fd to the string being built, reading
+ * straight into its end a large block at a time.
+ */
+void
+build_read(struct parse_ctx *ctx, int fd)
+{
+  enum { BLOCK = 64 * 1024 };
+  for (;;) {
+    build_reserve(ctx, BLOCK);
+    ssize_t ret = read(fd, ctx->base + ctx->len, BLOCK);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret == -1) {
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    }
+    if (ret <= 0) break;
+    ctx->len += ret;
+  }
+  ctx->base[ctx->len] = '\0';
+}
+
+/* Expands all instances of $! $$ $? ${param} and $(command) in a string
+ * Returns a string in the arena, valid until it is reset
+ */
+char *
+expand(struct parse_ctx *ctx, char const *word)
+{
+  char const *pos = word;
+  char const *start, *end;
+  char c = param_scan(pos, &start, &end);
+  build_str(ctx, NULL, NULL);
+  build_str(ctx, pos, start);
+  while (c) {
+    if (c == '(') {
+      if (ctx->subst) ctx->subst(ctx, start + 2, end - start - 3);
+    } else {
+      char const *name = c == '{' ? start + 2 : NULL;
+      size_t len = c == '{' ? end - start - 3 : 0;
+      char const *value = ctx->lookup(ctx, c, name, len);
+      if (value != NULL) {
+        build_str(ctx, value, NULL);
+      }
+    }
+    pos = end;
+    c = param_scan(pos, &start, &end);
+    build_str(ctx, pos, start);
+  }
+  return build_str(ctx, start, NULL);
+}
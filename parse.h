@@ -0,0 +1,81 @@
+/******************************************************************************
+** Program:     Small Shell
+** Description: Parsing kernels of smallsh: the per-line arena, the lexer,
+**              the parameter scanner and the expander. All of their state
+**              is in a struct parse_ctx, and what parameters expand to is
+**              asked of the caller through hooks, so they can be run,
+**              benchmarked and fuzzed outside the shell.
+******************************************************************************/
+#ifndef SMALLSH_PARSE_H
+#define SMALLSH_PARSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef ARENA_CHUNK
+#define ARENA_CHUNK 4096
+#endif
+#ifndef ARENA_KEEP
+#define ARENA_KEEP (16 * ARENA_CHUNK) // most arena_reset() keeps allocated
+#endif
+#define ARENA_ALIGN 16
+
+/* Per-line bump allocator. Words, expansions and tokens for the current
+ * line all come from here and are released together at the prompt.
+ */
+struct arena_chunk {
+  struct arena_chunk *prev;
+  size_t len;
+  size_t cap;
+  char data[];
+};
+struct arena {
+  struct arena_chunk *head;
+  size_t used;       // bytes handed out since the last reset
+  size_t high_water; // most bytes any one line has needed
+};
+
+/* Lexer output: a word or one of the shell operators */
+enum token_type {
+  TOK_WORD, TOK_BG, TOK_PIPE, TOK_READ, TOK_WRITE, TOK_APPEND,
+  TOK_HEREDOC, TOK_HERESTR
+};
+struct token {
+  enum token_type type;
+  bool expand; // text still has to be expanded (late binding)
+  char *text;
+};
+
+/* Lexer and expander state. words grows to the longest line seen and is
+ * reused after; expansions are built at the top of the arena. lookup
+ * gives the value of $c for c one of $ ! ?, or with c '{' of the
+ * parameter name[0, len), NULL for an empty one; subst appends the
+ * output of the command text[0, len) of a $( ... ) to ctx's string, and
+ * may be NULL to expand substitutions to nothing. data is the caller's.
+ */
+struct parse_ctx {
+  struct token *words;
+  size_t words_cap;
+  struct arena *arena;
+  char *base;    // string being built
+  size_t len;
+  size_t cap;    // bytes reserved for it in the arena
+  char const *(*lookup)(struct parse_ctx *ctx, char c,
+                        char const *name, size_t len);
+  void (*subst)(struct parse_ctx *ctx, char const *text, size_t len);
+  void *data;
+};
+
+void * arena_alloc(struct arena *a, size_t size);
+void * arena_grow(struct arena *a, void *ptr, size_t old_size, size_t size);
+void arena_reset(struct arena *a);
+void words_reserve(struct parse_ctx *ctx, size_t n);
+size_t lex(struct parse_ctx *ctx, char *line, bool late);
+char const * subst_end(char const *s);
+char param_scan(char const *word, char const **start, char const **end);
+char * build_str(struct parse_ctx *ctx, char const *start, char const *end);
+void build_reserve(struct parse_ctx *ctx, size_t n);
+void build_read(struct parse_ctx *ctx, int fd);
+char * expand(struct parse_ctx *ctx, char const *word);
+
+#endif
@@ -6,17 +6,50 @@
 ** Description: smallsh implements a command line interface similar to 
 **              well-known shells, such as bash. The program 
 **
-**                - Prints an interactive input prompt
+**                - Prints an interactive input prompt, waiting on input,
+**                  finished jobs and coprocess replies at once, or runs
+**                  a script mapped straight into memory, optionally from
+**                  a compiled, pre-lexed copy cached on disk (-C)
 **                - Parses command line input into semantic tokens
-**                - Implements parameter expansion
+**                - Implements parameter expansion and $(command)
+**                  substitution, read straight from a pipe or memfd
 **                - Interprets shell special parameters $$, $?, and $! and 
 **                  generic parameters as ${parameter}
-**                - Implements two shell built-in commands: exit and cd
+**                - Implements shell built-in commands: exit, cd, hash, jobs,
+**                  wait, times and memstat, plus echo, printf, true, false and
+**                  test/[ run in-process without forking
+**                - Accounts CPU time, max RSS and wall time per command,
+**                  optionally printing it after each one (-t)
 **                - Execute non-built-in commands using the the appropriate 
-**                  EXEC(3) function.
-**                - Implements redirection operators ‘<’,  ‘>’ and '>>'
+**                  EXEC(3) function, caching PATH lookups in a hash table
+**                - Implements redirection operators ‘<’,  ‘>’ and '>>', and
+**                  '<<' here-documents and '<<<' here-strings kept in
+**                  memory
+**                - Implements the '|' operator to run pipelines
+**                - Runs '@host command' on another host over a shared,
+**                  persistent ssh ControlMaster connection per host
+**                - Keeps a pool of long-lived coprocess workers fed
+**                  requests over pipes (coproc)
+**                - Memoizes deterministic commands' output and status in
+**                  an on-disk cache (memo)
+**                - Implements if/elif/else/fi, while/do/done and
+**                  for/in/do/done blocks, read once into a tree and run
+**                  from it with expansions redone on every pass
+**                - Optionally serves a bare '< file > file' copy in the
+**                  kernel, without forking (--direct-io)
 **                - Implements the ‘&’ operator to run commands in the 
-**                  background
+**                  background, reaping them from a SIGCHLD self-pipe and
+**                  capping how many run at once (-j N)
+**                - Optionally pins background jobs to CPU sets taken in
+**                  turn and places them in a cgroup ($SMALLSH_CPUSET,
+**                  $SMALLSH_CGROUP)
+**                - Implements pfor NAME in LIST [-j N] [-i] -- COMMAND,
+**                  fanning the command out over the list through the job
+**                  scheduler, with each item's output kept in order
+**                - Implements { ... } [wait] groups that start a set of
+**                  background jobs and join them, with the worst $?
+**                - Optionally traces each phase of each command into a
+**                  ring buffer, dumped as Chrome JSON or CSV (-T file)
 **                - Implement custom behavior for SIGINT and SIGTSTP signals
 ** 
 ******************************************************************************/
@@ -33,10 +66,23 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <signal.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <getopt.h>
+#include <stdarg.h>
+
+#include "parse.h"
 
 //MACROS///////////////////////////////////////////////////////////////////////
 
@@ -47,27 +93,453 @@
 #define dprintf(...) ((void)0)
 #endif
 
-#ifndef MAX_WORDS
-#define MAX_WORDS 1024
+#ifndef HASH_SIZE
+#define HASH_SIZE 64
+#endif
+
+#ifndef GROUP_KEEP
+#define GROUP_KEEP 64
+#endif
+
+#ifndef COPY_CHUNK
+#define COPY_CHUNK (1 << 20)
+#endif
+
+#define CACHE_MAGIC "smallshC"
+#define CACHE_VERSION 3
+#define MEMO_MAGIC "smallshM"
+
+#ifndef TRACE_RING
+#define TRACE_RING 65536 // trace events kept, the latest ones win
+#endif
+
+#ifndef PARAM_CACHE_SIZE
+#define PARAM_CACHE_SIZE 32
 #endif
 
 //FUNCTIONS////////////////////////////////////////////////////////////////////
 
-char *words[MAX_WORDS];
-size_t wordsplit(char const *line);
-char * expand(char const *word);
+struct script_map;
+bool script_map_open(struct script_map *m, int fd);
+ssize_t script_getline(struct script_map *m, char **line);
+struct line_reader;
+ssize_t stdin_getline(struct line_reader *r, char **line);
+struct compiled_script;
+struct cache_header;
+bool compile_script(struct compiled_script *cs, struct script_map *m,
+                    char const *script_fn);
+ssize_t compiled_getline(struct compiled_script *cs);
+char * cache_path(char const *fmt, ...);
+bool cache_sane(struct cache_header const *hdr);
+bool cache_load(struct compiled_script *cs, char const *path,
+                struct stat const *st, struct script_map const *m);
+void cache_store(struct compiled_script const *cs, char const *path);
+int mkdir_parents(char *path);
+uint64_t fnv1a64(void const *data, size_t len);
+char const * param_value(struct parse_ctx *ctx, char c,
+                         char const *name, size_t len);
+void substitute(struct parse_ctx *ctx, char const *text, size_t len);
+struct command;
+struct command * parse_commands(struct token const *toks, size_t n_words,
+                                size_t *n_cmds, bool *bg);
+void remote_rewrite(struct command *cmd, bool has_stdin);
+void run_command(size_t n_words);
+void command_done(void);
+ssize_t read_tokens(FILE *input, char **line, size_t *n, bool late);
+ssize_t read_line(FILE *input, char **line, size_t *n);
+void read_heredocs(FILE *input, char **line, size_t *n, size_t n_words);
+bool line_starts_block(char const *line);
+bool is_keyword(struct token const *tok, char const *keyword);
+bool block_start(struct token const *tok);
+void expand_words(struct token *toks, size_t n_toks);
+struct node;
+struct node * node_new(struct token const *toks, size_t n_toks);
+void node_free(struct node *node);
+struct node * block_error(struct node *node);
+ssize_t parse_list(FILE *input, char **line, size_t *n, struct node **list,
+                   char const *opener, char const *const ends[]);
+struct node * parse_stmt(FILE *input, char **line, size_t *n,
+                         size_t n_words);
+void run_tokens(struct token const *toks, size_t n_toks);
+void run_cond(struct node const *node);
+void run_nodes(struct node const *node);
+struct pfor_item;
+int run_pfor(struct token const *toks, size_t n_toks);
+size_t pfor_emit(struct pfor_item *slots, size_t n, size_t from);
+void trace_open(char const *path);
+uint64_t trace_now(void);
+void trace_span(int phase, uint64_t start);
+void trace_dump(void);
 void sigint_handler(int sig);
-int n_digits_counter(int n);
-FILE * open_read(char *read);
-FILE * open_write(char *write);
-FILE * open_append(char *append);
-void * update_output_descriptors(FILE *output);
-void * update_input_descriptors(FILE *input);
+void sigchld_handler(int sig);
+void sigchld_setup(void);
+struct job;
+struct job * job_new(struct command const *cmds, size_t n_cmds);
+void job_submit(struct command const *cmds, size_t n_cmds);
+void job_start(struct job *job);
+void job_done(struct job *job);
+struct placement;
+bool placement_next(struct placement *p);
+bool cpuset_parse(char const *list, size_t len, cpu_set_t *cpus);
+bool placement_apply(struct placement const *p);
+int group_new(void);
+struct group * group_get(int id);
+int group_wait(int id);
+int wait_status(int status);
+struct job * job_find(char const *spec);
+void schedule_jobs(void);
+void reap_children(bool block);
+size_t report_jobs(void);
+void print_jobs(void);
+int wait_jobs(char *specs[], int n_specs);
+struct command * commands_dup(struct command const *cmds, size_t n_cmds);
+struct usage;
+void usage_start(struct usage *u);
+void usage_add(struct usage *u, struct rusage const *ru);
+void usage_finish(struct usage *u);
+void print_usage(FILE *f, struct usage const *u);
+void print_times(void);
+struct num_str;
+char const * num_str(struct num_str *cache, int value);
+char const * param_lookup(char const *name, size_t len);
+int env_set(char const *name, char const *value);
+int open_read(char *read);
+int open_write(char *write);
+int open_append(char *append);
+int open_here(char *text);
+struct fd_plan;
+bool fd_plan_open(struct fd_plan *plan, struct command const *cmd,
+                  int in_fd, int out_fd);
+void fd_plan_close(struct fd_plan *plan);
+void fd_plan_apply(struct fd_plan const *plan);
+int copy_fd(int in_fd, int out_fd);
+char * hash_lookup(char const *name);
+void hash_reset(void);
+void hash_print(void);
+struct builtin;
+struct builtin const * builtin_find(char const *name);
+int swap_fd(int fd, int target, int *saved);
+int run_builtin(struct builtin const *bi, struct command const *cmd);
+int builtin_exit(int argc, char *argv[]);
+int builtin_cd(int argc, char *argv[]);
+int builtin_hash(int argc, char *argv[]);
+int builtin_jobs(int argc, char *argv[]);
+int builtin_wait(int argc, char *argv[]);
+int builtin_times(int argc, char *argv[]);
+int builtin_memstat(int argc, char *argv[]);
+int builtin_true(int argc, char *argv[]);
+int builtin_false(int argc, char *argv[]);
+int builtin_echo(int argc, char *argv[]);
+char const * print_escape(char const *c);
+int builtin_printf(int argc, char *argv[]);
+bool test_int(char const *s, long long *value);
+int test_not(int ret);
+int test_eval(int argc, char *argv[]);
+int builtin_test(int argc, char *argv[]);
+int builtin_coproc(int argc, char *argv[]);
+int coproc_start(long n, int argc, char *argv[]);
+int coproc_send(int argc, char *argv[]);
+size_t coproc_busy(void);
+void coproc_collect(void);
+struct worker;
+void coproc_retire(struct worker *w);
+void coproc_stop(void);
+int builtin_memo(int argc, char *argv[]);
+int memo_run(struct command const *cmd, int out_fd);
+pid_t spawn_command(char const *path, char *const argv[],
+                    struct fd_plan const *plan);
+pid_t launch_command(struct command const *cmd, int in_fd, int out_fd);
+size_t launch_pipeline(struct command const *cmds, size_t n_cmds,
+                       pid_t pids[], int out_fd);
 
 //GLOBALS//////////////////////////////////////////////////////////////////////
 
 int last_status = 0;
 int last_bg_pid = 0;
+bool direct_io = false; // serve bare '< in > out' lines in-process
+
+/* Script file mapped into memory and handed out a line at a time */
+struct script_map {
+  char *data;
+  size_t len;
+  size_t pos;
+  char *tail; // copy of a last line that ends exactly on a page boundary
+};
+struct script_map script = {0};
+
+/* Interactive input, read by stdin_getline() */
+struct line_reader {
+  char *buf;
+  size_t len, pos, cap; // pos: end of the line handed out last
+  bool eof;
+} stdin_reader = {0};
+
+/* Compiled script: every line lexed ahead of time into tokens whose
+ * expansions are left for when the line runs. It is stored in the cache
+ * file as a header followed by these arrays, and run straight from a
+ * read-only mapping of that file.
+ */
+struct cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_lines;
+  uint64_t size;       // script size, mtime and contents it was built from
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t hash;
+  uint32_t n_tokens;
+  uint32_t strtab_len;
+};
+struct compiled_token {
+  uint8_t type;
+  uint8_t expand;
+  uint32_t text; // offset into strtab
+};
+struct compiled_script {
+  struct cache_header hdr;
+  uint32_t *lines;               // n_lines + 1 indexes into tokens
+  struct compiled_token *tokens;
+  char *strtab;
+  uint32_t next;                 // next line to run
+  void *map;                     // cache file mapping, if loaded from one
+  size_t map_len;
+};
+struct compiled_script compiled = {0};
+
+/* memo cache entry: this header, then the command's output */
+struct memo_header {
+  char magic[8];
+  int32_t status;
+};
+bool compile_cache = false;
+
+/* SIGCHLD self-pipe: the handler writes a byte and raises the flag, and
+ * the children are reaped from the main loop only when it is up.
+ */
+int sigchld_pipe[2] = {-1, -1};
+volatile sig_atomic_t sigchld_pending = 0;
+
+/* Signal dispositions from before the shell changed them, restored
+ * in every child
+ */
+struct sigaction sigint_old = {0};
+struct sigaction sigtstp_old = {0};
+
+/* Resource usage of a foreground line or a background job */
+struct usage {
+  struct timespec start; // CLOCK_MONOTONIC
+  double wall;           // seconds, once finished
+  struct rusage ru;      // summed over every reaped stage
+};
+bool timing = false;       // print usage after every command
+bool line_timed = false;   // line_usage belongs to the line just run
+struct usage line_usage;   // line being run
+struct usage last_usage;   // last line that finished, for times
+
+/* Background job table. A job is one background pipeline; while the
+ * scheduler is at its limit (max_jobs, 0 for none) new jobs wait in the
+ * table as JOB_QUEUED and are started in order as running ones finish.
+ */
+enum job_state { JOB_QUEUED, JOB_RUNNING, JOB_DONE };
+struct job {
+  int id;
+  enum job_state state;
+  struct command *cmds;  // private copy of the pipeline
+  size_t n_cmds;
+  pid_t *pids;           // one per stage, -1 if it failed to start
+  size_t n_live;         // stages not reaped yet
+  pid_t pid;             // last stage, which gives the job its status
+  int status;            // wait status of the last stage
+  int group;             // group it was started in, 0 for none
+  int out_fd;            // last stage's stdout, -1 to inherit
+  bool quiet;            // not reported when done
+  struct usage usage;
+};
+struct job *jobs = NULL;
+size_t n_jobs = 0;
+size_t jobs_cap = 0;
+int next_job_id = 1;
+long max_jobs = 0;
+
+/* Background groups started by { ... } and pfor, numbered from 1. A
+ * group counts its jobs that are not done yet and keeps the worst $? of
+ * those that are, so it can be waited on after the jobs have left the
+ * table. Every live group is kept, but only the newest GROUP_KEEP
+ * finished ones; the table is in order of number, with gaps where
+ * groups were dropped.
+ */
+struct group {
+  int id;
+  size_t n_live;
+  int worst;
+};
+struct group *groups = NULL;
+size_t n_groups = 0; // groups numbered so far
+size_t groups_len = 0; // groups in the table
+size_t groups_cap = 0;
+int current_group = 0; // group being started, whose commands all go to jobs
+
+/* Where background jobs run: $SMALLSH_CPUSET lists CPU sets separated by
+ * ':', each written like taskset's "0-3,8", which jobs take in turn, and
+ * $SMALLSH_CGROUP names a cgroup v2 directory they join. Set while a job
+ * is being started, and applied in its children before the exec.
+ */
+struct placement {
+  bool pin;           // cpus is set
+  cpu_set_t cpus;
+  char const *cgroup; // NULL for none
+};
+struct placement const *placement = NULL;
+size_t next_cpuset = 0;
+
+/* Runtime tracing (-T FILE or SMALLSH_TRACE=FILE): each phase of each
+ * command is timed into a ring of events, written out at exit.
+ */
+enum trace_phase {
+  TRACE_GETLINE, TRACE_WORDSPLIT, TRACE_EXPAND, TRACE_PARSE, TRACE_FORK,
+  TRACE_EXEC, TRACE_WAIT
+};
+struct trace_event {
+  uint64_t start; // CLOCK_MONOTONIC, ns
+  uint64_t dur;
+  enum trace_phase phase;
+};
+struct trace {
+  bool on;
+  bool csv;
+  char const *path;
+  pid_t owner;
+  struct trace_event *ring;
+  size_t n_events; // ever recorded
+} trace = {0};
+
+/* Coprocess pool: workers started by coproc, each fed requests through
+ * to_fd and answering through from_fd, partial replies kept in buf.
+ * A worker that failed is retired: to_fd is -1 and it gets no more.
+ */
+struct worker {
+  pid_t pid;
+  int to_fd;
+  int from_fd;
+  bool busy;
+  char *buf;
+  size_t len, cap;
+};
+struct worker *workers = NULL;
+size_t n_workers = 0;
+int coproc_status = 0; // highest reply status since the last wait
+
+/* Block tree: if, while and for keep their body and else branch as
+ * lists of nodes. Commands and conditions keep their tokens as lexed,
+ * to be expanded each time they run; a for or pfor keeps its name, "in"
+ * and list, and a group what follows its '}'.
+ */
+enum node_type {
+  NODE_CMD, NODE_IF, NODE_WHILE, NODE_FOR, NODE_GROUP, NODE_PFOR
+};
+
+/* An item of a pfor: its job, and unless output is interleaved the
+ * memfd holding the output until it is its turn
+ */
+struct pfor_item {
+  int job_id; // 0 if it never became a job
+  int out_fd;
+};
+struct node {
+  enum node_type type;
+  struct node *next;
+  struct token *toks;
+  size_t n_toks;
+  struct node *body;
+  struct node *alt;
+};
+bool interrupted = false; // a foreground child died of SIGINT
+
+/* Descriptors a child gets as stdin/stdout (-1 to inherit), and those
+ * of them the parent opened for it, to close once it has started
+ */
+struct fd_plan {
+  int in, out;
+  int opened[4];
+  size_t n_opened;
+};
+
+/* Parser output: one stage of a pipeline */
+struct command {
+  char **argv;
+  int argc;
+  char *read;
+  char *write;
+  char *append;
+  char *here; // here-document or here-string text, fed to stdin
+};
+
+/* Per-line arena, and the lexer working in it: words[] grows to the
+ * longest line seen and is reused after
+ */
+struct arena line_arena = {0};
+struct parse_ctx lexer = {
+  .arena = &line_arena,
+  .lookup = param_value,
+  .subst = substitute,
+};
+
+/* Command hash table: command name -> resolved path */
+struct hash_entry {
+  struct hash_entry *next;
+  char *name;
+  char *path;
+  unsigned hits;
+};
+struct hash_entry *cmd_hash[HASH_SIZE];
+char *cmd_hash_path = NULL; // $PATH the table was filled under
+
+/* Expansion cache: special parameters are formatted only when they
+ * change, and ${name} lookups are memoized until the environment changes.
+ */
+struct num_str {
+  bool valid;
+  int value;
+  char str[3 * sizeof (int) + 2];
+};
+char shell_pid_str[3 * sizeof (pid_t) + 2];
+struct num_str last_status_str = {0};
+struct num_str last_bg_pid_str = {0};
+
+struct param_entry {
+  char *name;
+  char const *value;
+  unsigned gen;
+};
+struct param_entry param_cache[PARAM_CACHE_SIZE];
+unsigned env_generation = 1; // bumped by env_set() on every change
+
+/* Built-in commands, run by the shell itself. Pure ones don't touch the
+ * shell's state, so they can just as well run in a forked child when
+ * they are a pipeline stage or a background job.
+ */
+struct builtin {
+  char const *name;
+  int (*fn)(int argc, char *argv[]);
+  bool pure;
+};
+struct builtin const builtins[] = {
+  { "exit", builtin_exit, false },
+  { "cd", builtin_cd, false },
+  { "hash", builtin_hash, false },
+  { "jobs", builtin_jobs, false },
+  { "wait", builtin_wait, false },
+  { "times", builtin_times, false },
+  { "memstat", builtin_memstat, false },
+  { "echo", builtin_echo, true },
+  { "printf", builtin_printf, true },
+  { "true", builtin_true, true },
+  { "false", builtin_false, true },
+  { "test", builtin_test, true },
+  { "[", builtin_test, true },
+  { "coproc", builtin_coproc, false },
+  { "memo", builtin_memo, true },
+};
 
 //MAIN/////////////////////////////////////////////////////////////////////////
 
@@ -79,36 +551,90 @@ int main(int argc, char *argv[])
   FILE *og_input = stdin; // default input
   FILE *output = stderr;  // default output
 
+  // Parse options
+  static struct option const long_opts[] = {
+    {"direct-io", no_argument, NULL, 'd'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"timing", no_argument, NULL, 't'},
+    {"cache", no_argument, NULL, 'C'},
+    {"trace", required_argument, NULL, 'T'},
+    {0}
+  };
+  char const *jobs_arg = getenv("SMALLSH_JOBS");
+  char const *trace_arg = getenv("SMALLSH_TRACE");
+  int opt;
+  while ((opt = getopt_long(argc, argv, "+dj:tCT:", long_opts, NULL)) != -1) {
+    switch (opt) {
+    case 'd':
+      direct_io = true;
+      break;
+    case 'j':
+      jobs_arg = optarg;
+      break;
+    case 't':
+      timing = true;
+      break;
+    case 'C':
+      compile_cache = true;
+      break;
+    case 'T':
+      trace_arg = optarg;
+      break;
+    default:
+      errx(1, "usage: %s [--direct-io] [-j N] [-t] [-C] [-T file] [script]",
+           argv[0]);
+    }
+  }
+  if (trace_arg != NULL && *trace_arg != '\0') trace_open(trace_arg);
+  if (jobs_arg != NULL) {
+    char *end;
+    max_jobs = strtol(jobs_arg, &end, 10);
+    if (*jobs_arg == '\0' || *end != '\0' || max_jobs < 0) {
+      errx(1, "invalid job limit: %s", jobs_arg);
+    }
+  }
+
   // Initialize I/O
   char *input_fn = "(stdin)";
-  if (argc == 2) {
-    input_fn = argv[1];
-    og_input = fopen(input_fn, "re");
-    if (!og_input) err(1, "%s", input_fn);
-  } else if (argc > 2) {
+  if (argc - optind == 1) {
+    input_fn = argv[optind];
+    int input_fileno = open(input_fn, O_RDONLY | O_CLOEXEC);
+    if (input_fileno == -1) err(1, "%s", input_fn);
+
+    // Read regular script files through a mapping, with no stdio stream
+    if (script_map_open(&script, input_fileno)) {
+      dprintf("Script %s mapped, %zu bytes\n", input_fn, script.len);
+      close(input_fileno);
+      og_input = NULL;
+
+      // Replay a compiled copy instead of lexing line by line
+      if (compile_cache && compile_script(&compiled, &script, input_fn)) {
+        dprintf("Running %u compiled lines\n", compiled.hdr.n_lines);
+      }
+    } else {
+      og_input = fdopen(input_fileno, "r");
+      if (!og_input) err(1, "%s", input_fn);
+    }
+  } else if (argc - optind > 1) {
     errx(1, "too many arguments");
   }
 
-  FILE *input = og_input; // working input
+  FILE *input = og_input; // working input, NULL for a mapped script
+  snprintf(shell_pid_str, sizeof shell_pid_str, "%jd", (intmax_t) getpid());
   char *line = NULL;
   size_t n = 0;
 
-  // Set input stream to close-on-exec
-  if (input != stdin) {
-    int input_fileno = fileno(input);
-    fcntl(input_fileno, F_SETFD, FD_CLOEXEC);
-  }
-
 //SIGNALHANDLING///////////////////////////////////////////////////////////////
 
   // Initialize signal structs
   struct sigaction  sigint_act  = {0}, // set signal structs
-                    sigint_old  = {0}, 
-                    sigtstp_act = {0},
-                    sigtstp_old = {0};
+                    sigtstp_act = {0};
 
+  // A script sets nothing up until it needs to: SIGCHLD waits for its
+  // first job, and it keeps the signal dispositions it was started with
   if (input == stdin) { // only handle specially in interactive mode
     dprintf("Signals set for interactive mode.\n");
+    sigchld_setup(); // the prompt wakes up for finished jobs
     
     // SIGSTP
     sigtstp_act.sa_handler = SIG_IGN;
@@ -135,31 +661,12 @@ int main(int argc, char *argv[])
 
 prompt:;
 
-    // Manage bg processes
-    int bg_status = 0;
-    pid_t bg_pid = waitpid(0, &bg_status, WNOHANG | WUNTRACED);
-
-    if (bg_pid != -1 && bg_pid != 0) {
-      if (WIFEXITED(bg_status)) {
-        fprintf(stderr, 
-        "Child process %jd done. Exit status %d.\n", 
-        (intmax_t) bg_pid, WEXITSTATUS(bg_status));
-      }
-      if (WIFSIGNALED(bg_status)) {
-        fprintf(stderr, 
-        "Child process %jd done. Signaled %d.\n", 
-        (intmax_t) bg_pid, WTERMSIG(bg_status));
-      }
-      if (WIFSTOPPED(bg_status)) {
-        fprintf(stderr, 
-        "Child process %jd stopped. Continuing.\n", 
-        (intmax_t) bg_pid);
-        kill(bg_pid, SIGCONT);
-      }
-    }
+    // Account for the line just run and manage bg processes
+    command_done();
+    interrupted = false;
 
     // Reset working vars
-    clearerr(input);  // clear errors
+    if (input) clearerr(input); // clear errors
     errno = 0;        // reset errno
     input = og_input; // reset input
     output = stderr;  // reset output
@@ -167,26 +674,25 @@ prompt:;
     // Print prompt
     if (input == stdin) {
       // interactive mode
-      fprintf(stderr, "%s", expand("${PS1}"));
+      char const *ps1 = param_lookup("PS1", 3);
+      if (ps1) fputs(ps1, stderr);
     }
 
-//FLAGS////////////////////////////////////////////////////////////////////////
-
-    bool bg       = false;
-    char *read    = NULL;
-    char *write   = NULL;
-    char *append  = NULL;
-
 //GETLINE//////////////////////////////////////////////////////////////////////
     
-    // Read line of input
-    ssize_t line_len = getline(&line, &n, input);
+    // Read and lex a line of input
+    ssize_t n_words = read_tokens(input, &line, &n, false);
     dprintf("getline executed\n");
-    if (line_len < 0) {
+    if (n_words < 0) {
       dprintf("getline returned -1: error\n");
-      if (feof(input)) {
-        goto default_exit;
-      } else if (ferror(input)) {
+      if (compiled.lines || script.data || stdin_reader.eof || feof(input)) {
+        // Queued jobs still get to run
+        for (size_t i = 0; i < n_jobs; i++) {
+          while (jobs[i].state == JOB_QUEUED) reap_children(true);
+        }
+        report_jobs();
+        builtin_exit(1, NULL);
+      } else {
         dprintf("Loading prompt.\n");
         fprintf(output, "\n");
         goto prompt;
@@ -200,545 +706,3321 @@ prompt:;
     } 
     
     
-//SPLIT/EXPAND/////////////////////////////////////////////////////////////////
-    
-    // Wordsplit input
-    dprintf("executing wordsplit...\n");
-    size_t n_words = wordsplit(line);
-    dprintf("wordsplit executed\n");
-
-    // Expand input
-    dprintf("Executing expansion\n");
-    for (size_t i = 0; i < n_words; ++i) {
-      dprintf("Word %zu: %s  -->  ", i, words[i]);
-      char *exp_word = expand(words[i]);
-      free(words[i]);
-      words[i] = exp_word;
-      dprintf("%s\n", words[i]);
-    }
-
-#ifdef DEBUG // Check Expanded string
-  dprintf("Expanded input: ");
+#ifdef DEBUG // Check lexed string
+  dprintf("Lexed input: ");
   for (int i = 0; i < n_words; i++) {
-    dprintf("%s ", words[i]);
+    dprintf("%s ", lexer.words[i].text);
   }
   dprintf("\n");
 #endif
 
-//PARSING//////////////////////////////////////////////////////////////////////
-
-    // Parse words into tokens and deal with redirection operators
-    int i = 0;
-    int n_tokens = 0;
-    int op = 0;
-    char *tokens[MAX_WORDS];
+//EXECUTION////////////////////////////////////////////////////////////////////
 
-    for (i; i < n_words; i++) {
-      if (i == n_words - 1 && strcmp(words[i], "&") == 0) {
-        bg = true;
-        op++;
-        continue;
-      }
-      if (strcmp(words[i], ">") == 0) {
-        // write
-        write = words[i + 1];
-        i++;
-        op = op + 2;
-        output = open_write(write);
-        fclose(output);
-        continue;
-      }
-      if (strcmp(words[i], "<") == 0) {
-        // read
-        read = words[i + 1];
-        i++;
-        op = op + 2;
-        continue;
-      }
-      if (strcmp(words[i], ">>") == 0) {
-        // append
-        append = words[i + 1];
-        i++;
-        op = op + 2;
-        continue;
+    // Blocks are read in full, then run from their tree
+    if (n_words > 0 && block_start(&lexer.words[0])) {
+      struct node *block = parse_stmt(input, &line, &n, n_words);
+      if (block) {
+        run_nodes(block);
+        node_free(block);
+      } else {
+        fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+        last_status = 2; // syntax error
       }
-      tokens[i - op] = words[i];
-      dprintf("Token %d: %s\n", i - op, tokens[i - op]);
-      n_tokens++;
+      goto prompt;
     }
-    tokens[i - op] = NULL;
-    dprintf("Token %d: %s\n", i - op, tokens[i - op]);
-    n_tokens++;
+
+    expand_words(lexer.words, n_words);
+    run_command(n_words);
+    goto prompt;
+  } 
+}
+
+//FUNCTIONS////////////////////////////////////////////////////////////////////
+
+/* Parses the n_words tokens in words[], already expanded, into a
+ * pipeline and runs it: a built-in, a copy, or child processes that are
+ * waited on unless the line ends in '&'. Sets last_status.
+ */
+void
+run_command(size_t n_words) {
+  bool bg = false;
+  uint64_t t0 = trace_now();
+
+//PARSING//////////////////////////////////////////////////////////////////////
+
+  size_t n_cmds;
+  struct command *cmds = parse_commands(lexer.words, n_words, &n_cmds, &bg);
+  if (current_group) bg = true; // a group starts everything in it at once
+
+  // Built-ins only ever see the first stage
+  char **tokens = cmds[0].argv;
+  struct builtin const *builtin = NULL;
 
 #ifdef DEBUG //Check parsed string
-  dprintf("Parsed input: ");
-  for (int i = 0; i < n_tokens; i++) {
-    if (tokens[i] != NULL) {
-      dprintf("%s ", tokens[i]);
+  for (size_t i = 0; i < n_cmds; i++) {
+  dprintf("Parsed command %zu: ", i);
+  for (int j = 0; j <= cmds[i].argc; j++) {
+    if (cmds[i].argv[j] != NULL) {
+      dprintf("%s ", cmds[i].argv[j]);
     } else {
       dprintf("(null)");
     } 
   }
-  //print flags
-  dprintf("\nPrinting flags/globals...\n");
-  dprintf("bg: %d\n", bg);
-  if (write != NULL) {
-    dprintf("write: %s\n", write);
-  } else {
-    dprintf("write: (null)\n");
-  }
-  if (read != NULL) {
-    dprintf("read: %s\n", read);
-  } else {
-    dprintf("read: (null)\n");
+  dprintf("\nread: %s", cmds[i].read ? cmds[i].read : "(null)");
+  dprintf("\nwrite: %s", cmds[i].write ? cmds[i].write : "(null)");
+  dprintf("\nappend: %s\n", cmds[i].append ? cmds[i].append : "(null)");
   }
-  if (append != NULL) {
-    dprintf("append: %s\n", append);
-  } else {
-    dprintf("append: (null)\n");
-  } 
+  dprintf("bg: %d\n", bg);
 #endif
+  trace_span(TRACE_PARSE, t0);
 
 //EXECUTION////////////////////////////////////////////////////////////////////
 
-    // No command given
-    dprintf("executing commands\n");
-    if (tokens[0] == NULL) {
-      dprintf("No command given.\n");
-      goto prompt;
-
-//EXIT/////////////////////////////////////////////////////////////////////////
-
-    // Built-in exit command
-    } else if (strcmp(tokens[0], "exit") == 0) {
-      if (n_tokens - 1 >= 3) {
-        errno = E2BIG; // Too many arguments
-        fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-      } else if (n_tokens - 1 == 2) {
-        if (isdigit(*tokens[1]))
-        { // Check if argument is an integer
-          dprintf("Exit code: %s\n", tokens[1]);
-          exit(atoi(tokens[1]));  // Exit with argument
-        } else {
-          errno = EINVAL; // Argument is not an integer
-          fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-          goto prompt;
-        }
-      } else {
-default_exit:;
-        dprintf("Default exit: %s", expand("$?"));
-        exit(atoi(expand("$?")));
-      } 
-
-//CD///////////////////////////////////////////////////////////////////////////
-     
-    // Built-in change dir command
-
-    } else if (strcmp(tokens[0], "cd") == 0) {
-
-#ifdef DEBUG
-  char *cwd = NULL;
-#endif  
-
-      // Do cd stuff
-      if (n_tokens - 1 >= 3) {
-        errno = E2BIG; // too many arguments
-        fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-      } else if (n_tokens - 1 == 2) {
-        if (access(tokens[1], F_OK) != -1) {
-          dprintf("Changing directory to: %s\n", words[1]);
-          if (chdir(tokens[1]) != 0) { // change dir to arg
-            errno = ENOENT; // chdir failed
-            fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-          }
-
-#ifdef DEBUG
-  dprintf("New directory is %s\n", getcwd(cwd, 0));
-  free(cwd);
-#endif 
+  // Time everything but empty lines
+  if (n_words > 0) {
+    usage_start(&line_usage);
+    line_timed = true;
+  }
 
+  // No command given
+  dprintf("executing commands\n");
+  if (n_cmds == 1 && tokens[0] == NULL) {
+    dprintf("No command given.\n");
+
+    // Bare '< in > out': copy in the kernel instead of forking cat
+    char *out_fn = cmds[0].write ? cmds[0].write : cmds[0].append;
+    if (direct_io && cmds[0].read != NULL && out_fn != NULL) {
+      int in_fd = open_read(cmds[0].read);
+      int out_fd = -1;
+      if (in_fd != -1) {
+        out_fd = cmds[0].write ? open_write(out_fn) : open_append(out_fn);
+      }
+      last_status = EXIT_FAILURE;
+      if (out_fd != -1) {
+        if (copy_fd(in_fd, out_fd) == 0) {
+          last_status = EXIT_SUCCESS;
         } else {
-          errno = ENOTDIR; // not a directory
-          fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-        }
-      } else {
-        // change dir to home
-        dprintf("Changing directory to: %s\n", expand("${HOME}"));
-        if (chdir(expand("${HOME}")) != 0) {
-          errno = ENOENT; //chdir failed
           fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
         }
-
-#ifdef DEBUG
-  dprintf("New directory is %s\n", getcwd(cwd, 0));
-  free(cwd);
-#endif
-
-        goto prompt;
+        close(out_fd);
       }
+      if (in_fd != -1) close(in_fd);
+    } else {
+      // Still create or truncate the targets
+      struct fd_plan plan;
+      if (!fd_plan_open(&plan, &cmds[0], -1, -1)) last_status = EXIT_FAILURE;
+      else fd_plan_close(&plan);
+    }
+    return;
 
-//EXECVP///////////////////////////////////////////////////////////////////////
+//BUILTINS/////////////////////////////////////////////////////////////////////
 
-    // Execute non built-in commands as child processes
+  // Built-ins run in the shell; pure ones in the background go to jobs
+  } else if (n_cmds == 1 && (builtin = builtin_find(tokens[0])) != NULL
+             && !(bg && builtin->pure)) {
+    last_status = run_builtin(builtin, &cmds[0]);
+    return;
 
-    } else {
-      // Do execvp stuff
-      pid_t fork_pid  = -13; // set to bogus numbers in case of bad luck
-      pid_t child_pid = -13;
-      int child_exit  = -13;
+//EXECVP///////////////////////////////////////////////////////////////////////
 
-      fork_pid = fork();
+  // Execute non built-in commands as child processes
 
-      if (fork_pid == -1) {
-        // fork failed
+  } else {
+    // Every stage of a pipeline needs a command
+    for (size_t i = 0; i < n_cmds; i++) {
+      if (cmds[i].argc == 0) {
+        errno = EINVAL; // empty pipeline stage
         fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-        goto prompt;
-      } else if (fork_pid == 0) {
-        // Child Process
+        last_status = 2; // syntax error
+        return;
+      }
+    }
 
-        // Reset signals
-        if (sigaction(SIGINT, &sigint_old, NULL) == -1 
-        || sigaction(SIGTSTP, &sigtstp_old, NULL) == -1) {
-          dprintf("Signal restoration failed");
-          fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-          goto prompt;
-        }
+    // Background pipelines go through the job scheduler
+    if (bg == true) {
+      job_submit(cmds, n_cmds);
+      return;
+    }
 
-        // Set I/O and descriptors
-        if (append != NULL) {
-          // Do append stuff
-          output = open_append(append);
-          update_output_descriptors(output);
-        }
-        if (write != NULL) {
-          // Do Write stuff
-          output = open_write(write);
-          update_output_descriptors(output);
-        }
-        if (read != NULL) {
-          // Do read stuff
-          input = open_read(read);
-          update_input_descriptors(input);
-        }
+    // Start all stages before waiting on any of them
+    pid_t *pids = arena_alloc(&line_arena, sizeof *pids * n_cmds);
+    launch_pipeline(cmds, n_cmds, pids, -1);
+    pid_t fork_pid = pids[n_cmds - 1]; // $? follows the last stage
 
-        // Execute command
-        if (execvp(tokens[0], tokens) < 0) {
-          dprintf("execvp failed.\n");
-          fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-          exit(EXIT_FAILURE);
-        } else {
-          dprintf("Child #%d Process Executed.\n", (intmax_t) getpid());
-          exit(EXIT_SUCCESS);
-        }
-      }
-      // Parent Process
-      if (bg == true) {
-        // Don't wait on child process
-        last_bg_pid = fork_pid;
-        dprintf("Child #%d running in background.\n", fork_pid);
-        goto prompt;
-      } else {
-        // Wait on child process
-        dprintf("Parent #%d waiting for child #%d\n", 
-        (intmax_t) getpid(), (intmax_t) fork_pid);
-        child_pid = waitpid(fork_pid, &child_exit, WUNTRACED);
-
-        // Manage signals
-        if (WIFSIGNALED(child_exit)) {
-          dprintf("Child signaled with %d. $? set to %d\n",
-          WTERMSIG(child_exit), 128 + WTERMSIG(child_exit));
-          last_status = 128 + WTERMSIG(child_exit);
-        } else if (WIFSTOPPED(child_exit)) {
-          fprintf(stderr, 
-          "Child process %jd stopped. Continuing.\n", 
-          (intmax_t) fork_pid);
-          last_bg_pid = fork_pid;
-          last_status = child_exit;
-          kill(last_bg_pid, SIGCONT);
-          goto prompt;
-        } else {
-          last_status = WEXITSTATUS(child_exit);
-        }
+    // Parent Process
+    if (fork_pid == -1) {
+      last_status = EXIT_FAILURE; // last stage never started
+    }
 
-        dprintf("child #%d terminated with exit status #%d\n", 
-        (intmax_t) child_pid, WEXITSTATUS(last_status));
-        goto prompt;
+    for (size_t i = 0; i < n_cmds; i++) {
+      pid_t child_pid = -13; // set to bogus numbers in case of bad luck
+      int child_exit  = -13;
+      int status = 0;
+      if (pids[i] == -1) continue;
+
+      // Wait on child process
+      dprintf("Parent #%jd waiting for child #%jd\n", 
+      (intmax_t) getpid(), (intmax_t) pids[i]);
+      struct rusage ru;
+      t0 = trace_now();
+      child_pid = wait4(pids[i], &child_exit, WUNTRACED, &ru);
+      trace_span(TRACE_WAIT, t0);
+      if (!WIFSTOPPED(child_exit)) usage_add(&line_usage, &ru);
+
+      // Manage signals
+      if (WIFSIGNALED(child_exit)) {
+        dprintf("Child signaled with %d. $? set to %d\n",
+        WTERMSIG(child_exit), 128 + WTERMSIG(child_exit));
+        status = 128 + WTERMSIG(child_exit);
+        if (WTERMSIG(child_exit) == SIGINT) interrupted = true;
+      } else if (WIFSTOPPED(child_exit)) {
+        fprintf(stderr, 
+        "Child process %jd stopped. Continuing.\n", 
+        (intmax_t) pids[i]);
+        last_bg_pid = pids[i];
+        status = child_exit;
+        struct job *job = job_new(&cmds[i], 1);
+        job->state = JOB_RUNNING;
+        job->pids[0] = job->pid = last_bg_pid;
+        job->n_live = 1;
+        job->usage.start = line_usage.start;
+        kill(last_bg_pid, SIGCONT);
+      } else {
+        status = WEXITSTATUS(child_exit);
       }
+      if (pids[i] == fork_pid) last_status = status;
+
+      dprintf("child #%jd terminated with exit status #%d\n", 
+      (intmax_t) child_pid, status);
     }
-    goto prompt;
-  } 
+    return;
+  }
 }
 
-//FUNCTIONS////////////////////////////////////////////////////////////////////
+/* Splits expanded tokens into pipeline stages, in the line arena, and
+ * deals with the operators. Sets *n_cmds, and *bg if the last token is
+ * '&'.
+ */
+struct command *
+parse_commands(struct token const *toks, size_t n_words,
+               size_t *n_cmds, bool *bg) {
+  *n_cmds = 1;
+  for (size_t i = 0; i < n_words; i++) {
+    if (toks[i].type == TOK_PIPE) ++*n_cmds;
+  }
+  struct command *cmds = arena_alloc(&line_arena, sizeof *cmds * *n_cmds);
+  char **argv_buf = arena_alloc(&line_arena, 
+                                sizeof *argv_buf * (n_words + *n_cmds));
+  struct command *cmd = cmds;
+  *cmd = (struct command) { .argv = argv_buf };
+
+  for (size_t i = 0; i < n_words; i++) {
+    bool has_target = i + 1 < n_words;
+    switch (toks[i].type) {
+    case TOK_BG:
+      if (i == n_words - 1) {
+        *bg = true;
+        continue;
+      }
+      break; // '&' anywhere else is an ordinary word
+    case TOK_PIPE:
+      // start the next stage right after this one's argv
+      cmd->argv[cmd->argc] = NULL;
+      argv_buf += cmd->argc + 1;
+      ++cmd;
+      *cmd = (struct command) { .argv = argv_buf };
+      continue;
+    case TOK_WRITE:
+      if (has_target) cmd->write = toks[++i].text;
+      continue;
+    case TOK_READ:
+      if (has_target) cmd->read = toks[++i].text;
+      continue;
+    case TOK_APPEND:
+      if (has_target) cmd->append = toks[++i].text;
+      continue;
+    case TOK_HEREDOC:
+      if (has_target) cmd->here = toks[++i].text;
+      continue;
+    case TOK_HERESTR:
+      if (has_target) {
+        char const *text = toks[++i].text;
+        size_t len = strlen(text);
+        cmd->here = memcpy(arena_alloc(&line_arena, len + 2), text, len);
+        memcpy(cmd->here + len, "\n", 2);
+      }
+      continue;
+    case TOK_WORD:
+      break;
+    }
+    cmd->argv[cmd->argc] = toks[i].text;
+    dprintf("Token %d: %s\n", cmd->argc, cmd->argv[cmd->argc]);
+    cmd->argc++;
+  }
+  cmd->argv[cmd->argc] = NULL;
 
-char *words[MAX_WORDS] = {0};
+  // A stage without stdin of its own must not let ssh read the shell's
+  for (size_t i = 0; i < *n_cmds; i++) {
+    remote_rewrite(&cmds[i], i > 0 || cmds[i].read || cmds[i].here);
+  }
+  return cmds;
+}
 
-/* Splits a string into words delimited by whitespace. Recognizes
- * comments as '#' at the beginning of a word, and backslash escapes.
- *
- * Returns number of words parsed, and updates the words[] array
- * with pointers to the words, each as an allocated string.
+/* Rewrites "@host cmd args" into an ssh command that runs cmd on host,
+ * with each argument quoted for the remote shell. Connections are
+ * multiplexed: the first command to a host starts a ControlMaster whose
+ * socket is kept in the cache directory for $SMALLSH_SSH_PERSIST seconds
+ * (600 by default), and later ones only open a channel on it. ssh exits
+ * with the remote command's status, so $? and the job table work as for
+ * a local command. $SMALLSH_SSH names the ssh to run.
  */
-size_t wordsplit(char const *line) {
-  size_t wlen = 0;
-  size_t wind = 0;
-
-  char const *c = line;
-  for (;*c && isspace(*c); ++c); /* discard leading space */
+void
+remote_rewrite(struct command *cmd, bool has_stdin) {
+  static char *control_path = NULL; // "ControlPath=...", once the dir exists
+  if (cmd->argc < 2 || cmd->argv[0][0] != '@' || cmd->argv[0][1] == '\0') {
+    return;
+  }
+  if (!control_path) {
+    char *path = cache_path("ssh/%%C");
+    if (path && mkdir_parents(path) == 0
+    && asprintf(&control_path, "ControlPath=%s", path) == -1) {
+      control_path = NULL;
+    }
+    free(path);
+  }
 
-  for (; *c;) {
-    if (wind == MAX_WORDS) break;
-    /* read a word */
-    if (*c == '#') break;
-    for (;*c && !isspace(*c); ++c) {
-      if (*c == '\\') ++c;
-      void *tmp = realloc(words[wind], sizeof **words * (wlen + 2));
-      if (!tmp) err(1, "realloc");
-      words[wind] = tmp;
-      words[wind][wlen++] = *c; 
-      words[wind][wlen] = '\0';
+  char const *ssh = getenv("SMALLSH_SSH");
+  char const *persist = getenv("SMALLSH_SSH_PERSIST");
+  if (!ssh || !*ssh) ssh = "ssh";
+  if (!persist || !*persist) persist = "600";
+  char *persist_opt = arena_alloc(&line_arena, strlen(persist) + 16);
+  sprintf(persist_opt, "ControlPersist=%s", persist);
+
+  // cmd 'a b' 'it'\''s', as one argument for the remote shell
+  size_t size = 1;
+  for (int i = 1; i < cmd->argc; i++) size += strlen(cmd->argv[i]) * 4 + 3;
+  char *remote = arena_alloc(&line_arena, size);
+  char *r = remote;
+  for (int i = 1; i < cmd->argc; i++) {
+    if (i > 1) *r++ = ' ';
+    *r++ = '\'';
+    for (char const *c = cmd->argv[i]; *c; c++) {
+      if (*c == '\'') r = stpcpy(r, "'\\''");
+      else *r++ = *c;
     }
-    ++wind;
-    wlen = 0;
-    for (;*c && isspace(*c); ++c);
+    *r++ = '\'';
   }
-  return wind;
+  *r = '\0';
+
+  char **argv = arena_alloc(&line_arena, sizeof *argv * 13);
+  int argc = 0;
+  argv[argc++] = (char *) ssh;
+  if (control_path) {
+    argv[argc++] = "-o";
+    argv[argc++] = "ControlMaster=auto";
+    argv[argc++] = "-o";
+    argv[argc++] = control_path;
+    argv[argc++] = "-o";
+    argv[argc++] = persist_opt;
+  }
+  if (!has_stdin) argv[argc++] = "-n";
+  argv[argc++] = "--";
+  argv[argc++] = cmd->argv[0] + 1;
+  argv[argc++] = remote;
+  argv[argc] = NULL;
+  dprintf("Remote command for %s: %s\n", cmd->argv[0] + 1, remote);
+  cmd->argv = argv;
+  cmd->argc = argc;
 }
 
-
-/* Find next instance of a parameter within a word. Sets
- * start and end pointers to the start and end of the parameter
- * token.
+/* Finishes off the command just run: accounts its usage, reaps and
+ * reports background jobs and releases the line arena.
  */
-
-char
-param_scan(char const *word, char const **start, char const **end)
-{
-  static char const *prev;
-  if (!word) word = prev;
-  
-  char ret = 0;
-  *start = 0;
-  *end = 0;
-  for (char const *s = word; *s && !ret; ++s) {
-    s = strchr(s, '$');
-    if (!s) break;
-    switch (s[1]) {
-    case '$':
-    case '!':
-    case '?':
-      ret = s[1];
-      *start = s;
-      *end = s + 2;
-      break;
-    case '{':;
-      char *e = strchr(s + 2, '}');
-      if (e) {
-        ret = s[1];
-        *start = s;
-        *end = e + 1;
-      }
-      break;
+void
+command_done(void) {
+  if (line_timed) {
+    usage_finish(&line_usage);
+    last_usage = line_usage;
+    line_timed = false;
+    if (timing) {
+      fprintf(stderr, "Timing: ");
+      print_usage(stderr, &last_usage);
+      fprintf(stderr, "\n");
     }
   }
-  prev = *end;
-  return ret;
+
+  if (sigchld_pending) reap_children(false);
+  report_jobs();
+  arena_reset(&line_arena); // release last line's words and tokens
 }
 
-/* Simple string-builder function. Builds up a base
- * string by appending supplied strings/character ranges
- * to it.
+/* Reads the next line, from the compiled script, the mapped script or
+ * input, and lexes it into words[]. Expansions are left for later if late
+ * is set or the line starts a block, whose lines run more than once;
+ * compiled lines always leave them.
+ *
+ * Returns the number of tokens, or -1 at end of input or on error.
  */
-char *
-build_str(char const *start, char const *end)
-{
-  static size_t base_len = 0;
-  static char *base = 0;
-
-  if (!start) {
-    /* Reset; new base string, return old one */
-    char *ret = base;
-    base = NULL;
-    base_len = 0;
-    return ret;
+ssize_t
+read_tokens(FILE *input, char **line, size_t *n, bool late) {
+  uint64_t t0 = trace_now();
+  if (compiled.lines) {
+    ssize_t n_words = compiled_getline(&compiled);
+    trace_span(TRACE_GETLINE, t0);
+    return n_words;
   }
-  /* Append [start, end) to base string 
-   * If end is NULL, append whole start string to base string.
-   * Returns a newly allocated string that the caller must free.
-   */
-  size_t n = end ? end - start : strlen(start);
-  size_t newsize = sizeof *base *(base_len + n + 1);
-  void *tmp = realloc(base, newsize);
-  if (!tmp) err(1, "realloc");
-  base = tmp;
-  memcpy(base + base_len, start, n);
-  base_len += n;
-  base[base_len] = '\0';
 
-  return base;
+  ssize_t line_len = read_line(input, line, n);
+  trace_span(TRACE_GETLINE, t0);
+  if (line_len < 0) return -1;
+  t0 = trace_now();
+  size_t n_words = lex(&lexer, *line, late || line_starts_block(*line));
+  trace_span(TRACE_WORDSPLIT, t0);
+  read_heredocs(input, line, n, n_words);
+  return n_words;
+}
+
+/* Reads one raw line from the mapped script or input */
+ssize_t
+read_line(FILE *input, char **line, size_t *n) {
+  if (script.data) return script_getline(&script, line);
+  if (input == stdin) return stdin_getline(&stdin_reader, line);
+  return getline(line, n, input);
 }
 
-/* Expands all instances of $! $$ $? and ${param} in a string 
- * Returns a newly allocated string that the caller must free
+/* Reads the bodies of the line's here-documents, the lines after it up
+ * to each "<< DELIM" delimiter in turn, and puts each body in place of
+ * its delimiter word, to be expanded like one. The line's own tokens are
+ * moved into the arena first, since reading may reuse its buffer.
  */
-char *
-expand(char const *word)
-{
-  char const *pos = word;
-  char const *start, *end;
-  char c = param_scan(pos, &start, &end);
-  build_str(NULL, NULL);
-  build_str(pos, start);
-  while (c) {
-    if (c == '!') {
-      int n = n_digits_counter(last_bg_pid);
-      char bgpid_str[n];
-      snprintf(bgpid_str, n, "%d", last_bg_pid);
-      build_str(bgpid_str, NULL);
-    } else if (c == '$') {
-      int pid = getpid();
-      int n = n_digits_counter(pid);
-      char pid_str[n];
-      snprintf(pid_str, n, "%d", pid);
-      build_str(pid_str, NULL);
-    } else if (c == '?') {
-      int n = n_digits_counter(last_status);
-      if (last_status == 0) {
-        build_str("0", NULL);
-      } else {
-        char stat_str[n];
-        snprintf(stat_str, n, "%d", last_status);
-        build_str(stat_str, NULL);
+void
+read_heredocs(FILE *input, char **line, size_t *n, size_t n_words) {
+  bool any = false;
+  for (size_t i = 0; i + 1 < n_words && !any; i++) {
+    any = lexer.words[i].type == TOK_HEREDOC;
+  }
+  if (!any) return;
+  for (size_t i = 0; i < n_words; i++) {
+    size_t len = strlen(lexer.words[i].text) + 1;
+    char *copy = arena_alloc(&line_arena, len);
+    lexer.words[i].text = memcpy(copy, lexer.words[i].text, len);
+  }
+
+  for (size_t i = 0; i + 1 < n_words; i++) {
+    if (lexer.words[i].type != TOK_HEREDOC) continue;
+    char const *delim = lexer.words[++i].text;
+    char *body = arena_alloc(&line_arena, 1);
+    size_t len = 0;
+    for (;;) {
+      if (input == stdin && !script.data) {
+        char const *ps2 = param_lookup("PS2", 3);
+        if (ps2) fputs(ps2, stderr);
       }
-    }
-    else if (c == '{') {
-      int param_digits = end - start - 3;
-      char param_arg[64] = {0};
-      strncpy(param_arg, start + 2, param_digits);
-      char *param_str = getenv(param_arg);
-      if (param_str == NULL) {
-        build_str("", NULL);
-      } else {
-        build_str(param_str, NULL);
+      ssize_t line_len = read_line(input, line, n);
+      if (line_len < 0) break; // end of input ends the body too
+      if (line_len > 0 && (*line)[line_len - 1] == '\n') --line_len;
+      if ((size_t) line_len == strlen(delim)
+      && strncmp(*line, delim, line_len) == 0) {
+        break;
       }
+      body = arena_grow(&line_arena, body, len + 1, len + line_len + 2);
+      memcpy(body + len, *line, line_len);
+      len += line_len;
+      body[len++] = '\n';
     }
-    pos = end;
-    c = param_scan(pos, &start, &end);
-    build_str(pos, start);
+    body[len] = '\0';
+    lexer.words[i].text = body;
+    lexer.words[i].expand = strchr(body, '$') != NULL;
   }
-  return build_str(start, NULL);
 }
 
-void 
-sigint_handler(int sig) {
-  dprintf("\nsigint_handler called.\n");
+/* Checks, before lexing, whether a line starts with a block keyword */
+bool
+line_starts_block(char const *line) {
+  line += strspn(line, " \t");
+  size_t len = strcspn(line, " \t\n");
+  return (len == 1 && *line == '{')
+      || (len == 2 && strncmp(line, "if", 2) == 0)
+      || (len == 3 && strncmp(line, "for", 3) == 0)
+      || (len == 4 && strncmp(line, "pfor", 4) == 0)
+      || (len == 5 && strncmp(line, "while", 5) == 0);
 }
 
-int
-n_digits_counter(int n) {
-  int i = 1;
-  while (n > 0) {
-    n /= 10;
-    i++;
+/* Checks whether a token is the given keyword, written as-is */
+bool
+is_keyword(struct token const *tok, char const *keyword) {
+  return tok->type == TOK_WORD && !tok->expand
+      && strcmp(tok->text, keyword) == 0;
+}
+
+bool
+block_start(struct token const *tok) {
+  return is_keyword(tok, "if") || is_keyword(tok, "while")
+      || is_keyword(tok, "for") || is_keyword(tok, "{")
+      || is_keyword(tok, "pfor");
+}
+
+/* Expands the tokens that lexing left for later, into the line arena */
+void
+expand_words(struct token *toks, size_t n_toks) {
+  for (size_t i = 0; i < n_toks; i++) {
+    if (toks[i].expand) {
+      uint64_t t0 = trace_now();
+      toks[i].text = expand(&lexer, toks[i].text);
+      trace_span(TRACE_EXPAND, t0);
+      toks[i].expand = false;
+    }
   }
-  return i;
 }
 
-FILE *
-open_read(char * read) {
-  FILE* input = fopen(read, "re");
-  if (input) {
-    dprintf("Input stream set to %s\n", read);
-  } else {
-    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-    exit(EXIT_FAILURE);
+/* Makes a command node holding a copy of n_toks tokens, unexpanded, with
+ * their text, in one allocation.
+ */
+struct node *
+node_new(struct token const *toks, size_t n_toks) {
+  size_t size = sizeof (struct node) + sizeof *toks * n_toks;
+  for (size_t i = 0; i < n_toks; i++) size += strlen(toks[i].text) + 1;
+
+  struct node *node = malloc(size);
+  if (!node) err(1, "malloc");
+  *node = (struct node) {
+    .type = NODE_CMD,
+    .toks = (struct token *) (node + 1),
+    .n_toks = n_toks,
+  };
+  char *text = (char *) (node->toks + n_toks);
+  for (size_t i = 0; i < n_toks; i++) {
+    node->toks[i] = toks[i];
+    node->toks[i].text = text;
+    text = stpcpy(text, toks[i].text) + 1;
   }
-  return input;
+  return node;
 }
 
-FILE *
-open_write(char *write) {
-  FILE* output;
-  if (access(write, W_OK) == -1) {
-  // File doesn't exist, so create write-only with perms 0777
-    output = fopen(write, "w");
-    if (output) {
-      if (chmod(write, 511) != -1) {
-        dprintf("File \"%s\" created with permission 0777\n", write);
-      } else {
-        dprintf("chmod failed.\n");
-        fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-        exit(EXIT_FAILURE);        
-      }
-    } else {
-      dprintf("Failed to create file %s\n", write);
-      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-      exit(EXIT_FAILURE);
+void
+node_free(struct node *node) {
+  while (node) {
+    struct node *next = node->next;
+    node_free(node->body);
+    node_free(node->alt);
+    free(node);
+    node = next;
+  }
+}
+
+/* Frees what there is of a block that does not parse, keeping errno.
+ * Always returns NULL.
+ */
+struct node *
+block_error(struct node *node) {
+  int saved_errno = errno;
+  node_free(node);
+  errno = saved_errno;
+  return NULL;
+}
+
+/* Reads the lines of a block body into *list, up to a line starting with
+ * one of the ends keywords, which is left in words[]. A first line that
+ * is just the opener ("then" or "do") is skipped, so it may go on a line
+ * of its own as in sh.
+ *
+ * Returns the number of tokens in that last line, or -1 at end of input
+ * or on a syntax error.
+ */
+ssize_t
+parse_list(FILE *input, char **line, size_t *n, struct node **list,
+           char const *opener, char const *const ends[]) {
+  *list = NULL;
+  struct node **tail = list;
+  for (;;) {
+    if (input == stdin) {
+      char const *ps2 = param_lookup("PS2", 3);
+      if (ps2) fputs(ps2, stderr);
     }
-    } else {
-    output = fopen(write, "w");
-    if (output) {
-      dprintf("Output stream set to %s\n", write);
-    } else {
-      dprintf("Failed to open output stream.\n");
-      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-      exit(EXIT_FAILURE);
+    ssize_t n_words = read_tokens(input, line, n, true);
+    if (n_words < 0) {
+      errno = EINVAL; // block never closed
+      return -1;
+    }
+    if (n_words == 0) continue;
+
+    for (size_t i = 0; ends[i]; i++) {
+      if (is_keyword(&lexer.words[0], ends[i])) return n_words;
     }
+    if (!*list && n_words == 1 && is_keyword(&lexer.words[0], opener)) continue;
+
+    *tail = parse_stmt(input, line, n, n_words);
+    if (!*tail) return -1;
+    tail = &(*tail)->next;
   }
-  return output;
 }
 
-FILE *
-open_append(char *append) {
-  FILE* output;
-  if (access(append, W_OK) == -1) {
-    // File doesn't exist, so create write-only with perms 0777
-    output = fopen(append, "a");
-    if (output) {
-      if (chmod(append, 511) != -1) {
-        dprintf("File \"%s\" created with permission 0777\n", append);
-      } else {
-        dprintf("chmod failed.\n");
-        fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-        exit(EXIT_FAILURE);        
+/* Parses the statement whose first line is in words[]: a plain command,
+ * or an if, while, for or { group block, reading the rest of the block.
+ *
+ * Returns the node, or NULL with errno set on a syntax error.
+ */
+struct node *
+parse_stmt(FILE *input, char **line, size_t *n, size_t n_words) {
+  static char const *const if_ends[] = { "elif", "else", "fi", NULL };
+  static char const *const fi_end[] = { "fi", NULL };
+  static char const *const done_end[] = { "done", NULL };
+  static char const *const group_end[] = { "}", NULL };
+  struct node *node;
+
+  if (is_keyword(&lexer.words[0], "if")
+  || is_keyword(&lexer.words[0], "elif")) {
+    // if COND / [then] / ... / [elif COND / ...] / [else / ...] / fi
+    errno = EINVAL; // no condition
+    if (n_words < 2) return block_error(NULL);
+    node = node_new(lexer.words + 1, n_words - 1);
+    node->type = NODE_IF;
+    ssize_t n_end = parse_list(input, line, n, &node->body, "then", if_ends);
+    if (n_end < 0) return block_error(node);
+    if (is_keyword(&lexer.words[0], "elif")) {
+      // an elif is the else branch's if, and ends with the same fi
+      node->alt = parse_stmt(input, line, n, n_end);
+      if (!node->alt) return block_error(node);
+    } else if (is_keyword(&lexer.words[0], "else")
+    && parse_list(input, line, n, &node->alt, "", fi_end) < 0) {
+      return block_error(node);
+    }
+  } else if (is_keyword(&lexer.words[0], "while")) {
+    // while COND / [do] / ... / done
+    errno = EINVAL; // no condition
+    if (n_words < 2) return block_error(NULL);
+    node = node_new(lexer.words + 1, n_words - 1);
+    node->type = NODE_WHILE;
+    if (parse_list(input, line, n, &node->body, "do", done_end) < 0) {
+      return block_error(node);
+    }
+  } else if (is_keyword(&lexer.words[0], "for")) {
+    // for NAME in WORDS... / [do] / ... / done
+    errno = EINVAL; // no name or no "in"
+    if (n_words < 3 || lexer.words[1].type != TOK_WORD || lexer.words[1].expand
+    || !is_keyword(&lexer.words[2], "in")) {
+      return block_error(NULL);
+    }
+    node = node_new(lexer.words + 1, n_words - 1); // name, in, words
+    node->type = NODE_FOR;
+    if (parse_list(input, line, n, &node->body, "do", done_end) < 0) {
+      return block_error(node);
+    }
+  } else if (is_keyword(&lexer.words[0], "pfor")) {
+    // pfor NAME in LIST [-j N] [-i] -- COMMAND, all on one line
+    node = node_new(lexer.words + 1, n_words - 1);
+    node->type = NODE_PFOR;
+  } else if (is_keyword(&lexer.words[0], "{") && n_words == 1) {
+    // { / ... / } [wait]
+    node = node_new(NULL, 0);
+    node->type = NODE_GROUP;
+    ssize_t n_end = parse_list(input, line, n, &node->body, "", group_end);
+    if (n_end < 0) return block_error(node);
+    struct node *end = node_new(lexer.words + 1, n_end - 1);
+    end->type = NODE_GROUP;
+    end->body = node->body;
+    free(node);
+    node = end;
+  } else if (is_keyword(&lexer.words[0], "{")) {
+    // { a & b & ... } [wait], all on one line
+    size_t close = n_words;
+    while (close > 1 && !is_keyword(&lexer.words[close - 1], "}")) --close;
+    errno = EINVAL; // no closing '}'
+    if (close == 1) return block_error(NULL);
+    node = node_new(lexer.words + close, n_words - close);
+    node->type = NODE_GROUP;
+    struct node **tail = &node->body;
+    for (size_t i = 1, first = 1; i < close - 1; ++i) {
+      bool last = i + 2 == close;
+      if (lexer.words[i].type != TOK_BG && !last) continue;
+      size_t stop = lexer.words[i].type == TOK_BG ? i : i + 1;
+      if (stop > first) {
+        *tail = node_new(lexer.words + first, stop - first);
+        tail = &(*tail)->next;
       }
-    } else {
-      dprintf("Failed to create file %s\n", append);
-      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-      exit(EXIT_FAILURE);
+      first = i + 1;
     }
   } else {
-    output = fopen(append, "a");
-    if (output) {
-      dprintf("Output stream set to %s\n", append);
-    } else {
-      dprintf("Failed to open output stream.\n");
-      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-      exit(EXIT_FAILURE);
-    }
+    node = node_new(lexer.words, n_words);
   }
-  return output;
-}
 
-void * 
-update_input_descriptors(FILE *input) {
-  if (dup2(fileno(input), STDIN_FILENO) != -1) {
-    dprintf("STDIN_FILENO updated to %d\n", fileno(input));
-  } else {
-    errno = EBADF;
-    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-    exit(EXIT_FAILURE);
+  // Only a wait may follow a group's '}'
+  errno = EINVAL;
+  if (node->type == NODE_GROUP && (node->n_toks > 1
+  || (node->n_toks == 1 && !is_keyword(&node->toks[0], "wait")))) {
+    return block_error(node);
   }
+  return node;
 }
 
-void * 
-update_output_descriptors(FILE *output) {
-  if (dup2(fileno(output), STDOUT_FILENO) != -1) {
-    dprintf("STDOUT_FILENO updated to %d\n", fileno(output));
-  } else {
-    errno = EBADF;
-    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
-    exit(EXIT_FAILURE);
-  }
+/* Runs a pre-lexed command: its tokens are copied into words[] and
+ * expanded afresh, and it is finished off as if it had been read.
+ */
+void
+run_tokens(struct token const *toks, size_t n_toks) {
+  words_reserve(&lexer, n_toks);
+  memcpy(lexer.words, toks, sizeof *toks * n_toks);
+  expand_words(lexer.words, n_toks);
+  run_command(n_toks);
+  command_done();
 }
 
+/* Runs a condition, which always runs in the foreground, even inside a
+ * group, since its $? is needed right away.
+ */
+void
+run_cond(struct node const *node) {
+  int group = current_group;
+  current_group = 0;
+  run_tokens(node->toks, node->n_toks);
+  current_group = group;
+}
+
+/* Runs a list of nodes. Conditions are commands whose $? decides; a block
+ * leaves $? from the last command it ran, or 0 if it ran none. A loop
+ * stops early if a foreground child is interrupted by SIGINT. A group
+ * starts everything in it as background jobs; with "} wait" it then
+ * waits for all of them and leaves the worst $?.
+ */
+void
+run_nodes(struct node const *node) {
+  for (; node && !interrupted; node = node->next) {
+    switch (node->type) {
+    case NODE_CMD:
+      run_tokens(node->toks, node->n_toks);
+      break;
+    case NODE_IF:
+      run_cond(node);
+      if (interrupted) break;
+      bool taken = last_status == 0;
+      last_status = 0;
+      run_nodes(taken ? node->body : node->alt);
+      break;
+    case NODE_WHILE: {
+      int status = 0;
+      for (;;) {
+        run_cond(node);
+        if (last_status != 0 || interrupted) break;
+        last_status = 0;
+        run_nodes(node->body);
+        status = last_status;
+      }
+      last_status = status;
+      break;
+    }
+    case NODE_FOR: {
+      // The list is expanded once, before the first pass
+      size_t n_items = node->n_toks - 2;
+      struct token *items = arena_alloc(&line_arena, sizeof *items * n_items);
+      memcpy(items, node->toks + 2, sizeof *items * n_items);
+      expand_words(items, n_items);
+      size_t size = 0;
+      for (size_t i = 0; i < n_items; i++) size += strlen(items[i].text) + 1;
+      char *values = malloc(size + 1); // outlives the arena
+      if (!values) err(1, "malloc");
+      char *v = values;
+      for (size_t i = 0; i < n_items; i++) v = stpcpy(v, items[i].text) + 1;
+
+      last_status = 0;
+      v = values;
+      for (size_t i = 0; i < n_items && !interrupted; i++) {
+        env_set(node->toks[0].text, v);
+        v += strlen(v) + 1;
+        run_nodes(node->body);
+      }
+      free(values);
+      break;
+    }
+    case NODE_GROUP: {
+      int outer = current_group;
+      int group = current_group = group_new();
+      run_nodes(node->body);
+      current_group = outer;
+      last_status = node->n_toks ? group_wait(group) : 0;
+      break;
+    }
+    case NODE_PFOR:
+      last_status = run_pfor(node->toks, node->n_toks);
+      break;
+    }
+  }
+}
+
+/* Runs pfor NAME in LIST [-j N] [-i] -- COMMAND: the command, expanded
+ * with NAME set to each item of the list in turn, as background jobs of
+ * their own group, at most N at once (by default one per online CPU).
+ * The list is expanded once and split at whitespace, as xargs splits
+ * its input. Each item's output is kept in a memfd and written out in
+ * the list's order as soon as the items before it are done, or with -i
+ * goes straight to stdout, interleaved.
+ *
+ * Returns the worst $? of the items, or 2 on a usage error.
+ */
+int
+run_pfor(struct token const *toks, size_t n_toks) {
+  size_t dashes = 0;
+  while (dashes < n_toks && !is_keyword(&toks[dashes], "--")) ++dashes;
+  if (dashes < 2 || dashes + 1 >= n_toks || !is_keyword(&toks[1], "in")) {
+    errno = EINVAL; // not NAME in LIST -- COMMAND
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    return 2;
+  }
+
+  // The head is expanded once; the command is expanded per item
+  struct token *head = arena_alloc(&line_arena, sizeof *head * dashes);
+  memcpy(head, toks, sizeof *head * dashes);
+  expand_words(head, dashes);
+  size_t size = 0;
+  for (size_t i = 2; i < dashes; i++) size += strlen(head[i].text) + 1;
+  char *items = malloc(size + 1); // outlives the arena
+  if (!items) err(1, "malloc");
+
+  long n_par = sysconf(_SC_NPROCESSORS_ONLN);
+  bool interleave = false;
+  size_t n_items = 0;
+  char *v = items;
+  for (size_t i = 2; i < dashes; i++) {
+    char const *t = head[i].text;
+    if (strcmp(t, "-i") == 0) {
+      interleave = true;
+      continue;
+    } else if (strcmp(t, "-j") == 0 && i + 1 < dashes) {
+      char *end;
+      t = head[++i].text;
+      n_par = strtol(t, &end, 10);
+      if (*t == '\0' || *end != '\0' || n_par < 1) {
+        errno = EINVAL; // not a job count
+        fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+        free(items);
+        return 2;
+      }
+      continue;
+    }
+    for (t += strspn(t, " \t\n"); *t; t += strspn(t, " \t\n")) {
+      size_t len = strcspn(t, " \t\n");
+      memcpy(v, t, len);
+      v[len] = '\0';
+      v += len + 1;
+      t += len;
+      ++n_items;
+    }
+  }
+  if (n_par < 1) n_par = 1;
+
+  struct pfor_item *slots = malloc(sizeof *slots * (n_items + 1));
+  if (!slots) err(1, "malloc");
+  int group = group_new();
+  size_t n_tmpl = n_toks - dashes - 1;
+  size_t started = 0, emitted = 0;
+  bool failed = false;
+  v = items;
+  for (; started < n_items && !interrupted && !failed; ++started) {
+    while (group_get(group)->n_live >= (size_t) n_par) {
+      reap_children(true);
+      emitted = pfor_emit(slots, started, emitted);
+    }
+    env_set(toks[0].text, v);
+    v += strlen(v) + 1;
+
+    struct token *tmpl = arena_alloc(&line_arena, sizeof *tmpl * n_tmpl);
+    memcpy(tmpl, toks + dashes + 1, sizeof *tmpl * n_tmpl);
+    expand_words(tmpl, n_tmpl);
+    size_t n_cmds;
+    bool bg = false; // pfor puts every item in the background anyway
+    struct command *cmds = parse_commands(tmpl, n_tmpl, &n_cmds, &bg);
+
+    slots[started] = (struct pfor_item) { .out_fd = -1 };
+    for (size_t i = 0; i < n_cmds; i++) {
+      if (cmds[i].argc == 0) {
+        errno = EINVAL; // empty pipeline stage
+        failed = true;
+      }
+    }
+    if (!failed && !interleave) {
+      slots[started].out_fd = memfd_create("smallsh-pfor", MFD_CLOEXEC);
+      failed = slots[started].out_fd == -1;
+    }
+    if (failed) {
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    } else {
+      struct job *job = job_new(cmds, n_cmds);
+      job->group = group;
+      job->out_fd = slots[started].out_fd;
+      job->quiet = true;
+      ++group_get(group)->n_live;
+      slots[started].job_id = job->id;
+      dprintf("pfor item %zu is job %d.\n", started, job->id);
+      schedule_jobs();
+    }
+    arena_reset(&line_arena); // the job has its own copy
+  }
+
+  while (group_get(group)->n_live > 0) {
+    reap_children(true);
+    emitted = pfor_emit(slots, started, emitted);
+  }
+  pfor_emit(slots, started, emitted);
+  free(items);
+  free(slots);
+
+  int status = group_get(group)->worst;
+  if (failed && status == 0) status = EXIT_FAILURE;
+  return status;
+}
+
+/* Writes out, in order from item from, the kept output of the pfor items
+ * that are done, stopping at the first one that is not. Returns the
+ * first item not written out yet.
+ */
+size_t
+pfor_emit(struct pfor_item *slots, size_t n, size_t from) {
+  for (; from < n; ++from) {
+    struct job const *job = NULL;
+    for (size_t i = 0; i < n_jobs && !job; ++i) {
+      if (jobs[i].id == slots[from].job_id) job = &jobs[i];
+    }
+    if (job && job->state != JOB_DONE) break;
+    int fd = slots[from].out_fd;
+    if (fd == -1) continue;
+    fflush(stdout);
+    if (lseek(fd, 0, SEEK_SET) == -1 || copy_fd(fd, STDOUT_FILENO) == -1) {
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    }
+    close(fd);
+  }
+  return from;
+}
+
+/* Maps a script file privately and writably, so its lines can be split
+ * in place. Only regular, non-empty files are mapped.
+ *
+ * Returns false if the file has to be read with getline() instead.
+ */
+bool
+script_map_open(struct script_map *m, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    return false;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, 0);
+  if (data == MAP_FAILED) return false;
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  *m = (struct script_map) { .data = data, .len = st.st_size };
+  return true;
+}
+
+/* Hands out the next line of a mapped script as a NUL-terminated slice of
+ * the mapping, with its newline overwritten, so the line reaches the lexer
+ * without being copied. A last line without a newline is terminated by
+ * the zero fill after the end of the file, unless the file ends exactly
+ * on a page boundary, in which case it is copied.
+ *
+ * Returns the line length, or -1 at the end of the script.
+ */
+ssize_t
+script_getline(struct script_map *m, char **line) {
+  if (m->pos >= m->len) return -1;
+  char *start = m->data + m->pos;
+  size_t left = m->len - m->pos;
+
+  char *nl = memchr(start, '\n', left);
+  if (nl) {
+    *nl = '\0';
+    m->pos += nl - start + 1;
+    *line = start;
+    return nl - start;
+  }
+
+  m->pos = m->len;
+  if (m->len % sysconf(_SC_PAGESIZE) != 0) {
+    start[left] = '\0';
+    *line = start;
+  } else {
+    m->tail = strndup(start, left);
+    if (!m->tail) err(1, "strndup");
+    *line = m->tail;
+  }
+  return left;
+}
+
+/* Reads the next interactive line through an event loop instead of
+ * blocking in getline(): while waiting for stdin it also watches the
+ * SIGCHLD self-pipe, reporting finished jobs as they finish (and
+ * prompting again), and the coprocess workers' replies. The loop sleeps
+ * in poll() until one of them is ready.
+ *
+ * The line is returned in place in the reader's buffer, NUL-terminated
+ * instead of newline-terminated, valid until the next call. Returns its
+ * length, or -1 at end of input (with r->eof set) or on error.
+ */
+ssize_t
+stdin_getline(struct line_reader *r, char **line) {
+  // Drop the line handed out last time
+  r->len -= r->pos;
+  memmove(r->buf, r->buf + r->pos, r->len);
+  r->pos = 0;
+
+  for (;;) {
+    char *nl = r->len ? memchr(r->buf, '\n', r->len) : NULL;
+    if (nl || (r->eof && r->len > 0)) {
+      size_t end = nl ? (size_t) (nl - r->buf) : r->len;
+      r->buf[end] = '\0'; // room is kept for it
+      r->pos = nl ? end + 1 : r->len;
+      *line = r->buf;
+      return end;
+    }
+    if (r->eof) return -1;
+
+    struct pollfd fds[2 + n_workers];
+    fds[0] = (struct pollfd) { .fd = STDIN_FILENO, .events = POLLIN };
+    fds[1] = (struct pollfd) { .fd = sigchld_pipe[0], .events = POLLIN };
+    nfds_t n_fds = 2;
+    for (size_t i = 0; i < n_workers; ++i) {
+      if (workers[i].busy) fds[n_fds++] = (struct pollfd) {
+        .fd = workers[i].from_fd, .events = POLLIN,
+      };
+    }
+    if (poll(fds, n_fds, -1) == -1) {
+      if (errno == EINTR && sigchld_pending) continue;
+      return -1; // SIGINT, or a real error
+    }
+
+    // Things that happened while the user was typing
+    bool prompt = false;
+    if (fds[1].revents & POLLIN) {
+      reap_children(false);
+      prompt = report_jobs() > 0;
+    }
+    for (nfds_t i = 2; i < n_fds; ++i) {
+      if (fds[i].revents) {
+        coproc_collect();
+        prompt = true;
+        break;
+      }
+    }
+    if (prompt) {
+      char const *ps1 = param_lookup("PS1", 3);
+      if (ps1) fputs(ps1, stderr);
+    }
+
+    if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+    if (r->cap - r->len < 2) {
+      r->cap = r->cap ? r->cap * 2 : 4096;
+      r->buf = realloc(r->buf, r->cap);
+      if (!r->buf) err(1, "realloc");
+    }
+    ssize_t n = read(STDIN_FILENO, r->buf + r->len, r->cap - r->len - 1);
+    if (n == -1) {
+      if (errno == EINTR && sigchld_pending) continue;
+      return -1;
+    }
+    if (n == 0) r->eof = true;
+    r->len += n;
+  }
+}
+
+/* Lexes a whole mapped script into cs without expanding anything, or
+ * loads the result of doing so from the cache, and stores it there for
+ * next time. The cache entry is found by the script's path; it is used
+ * as-is if the script's size and mtime still match, and otherwise only
+ * if a hash of the contents does.
+ *
+ * Returns false if the script could not be compiled.
+ */
+bool
+compile_script(struct compiled_script *cs, struct script_map *m,
+               char const *script_fn) {
+  struct stat st;
+  char *abs = realpath(script_fn, NULL);
+  if (!abs) return false;
+  uint64_t key = fnv1a64(abs, strlen(abs)); // one entry per script path
+  free(abs);
+  char *path = cache_path("%016jx.ssc", (uintmax_t) key);
+  if (!path) return false;
+  if (stat(script_fn, &st) == -1) {
+    free(path);
+    return false;
+  }
+  if (cache_load(cs, path, &st, m)) {
+    free(path);
+    return true;
+  }
+
+  *cs = (struct compiled_script) {
+    .hdr = {
+      .magic = CACHE_MAGIC,
+      .version = CACHE_VERSION,
+      .size = st.st_size,
+      .mtime_sec = st.st_mtim.tv_sec,
+      .mtime_nsec = st.st_mtim.tv_nsec,
+      .hash = fnv1a64(m->data, m->len),
+    },
+  };
+
+  // Lex every line, collecting tokens and their text
+  size_t lines_cap = 64, tokens_cap = 256, strtab_cap = m->len + 1;
+  cs->lines = malloc(sizeof *cs->lines * lines_cap);
+  cs->tokens = malloc(sizeof *cs->tokens * tokens_cap);
+  cs->strtab = malloc(strtab_cap);
+  if (!cs->lines || !cs->tokens || !cs->strtab) err(1, "malloc");
+  cs->lines[0] = 0;
+
+  char *line;
+  while (script_getline(m, &line) >= 0) {
+    size_t n_words = lex(&lexer, line, true);
+    read_heredocs(NULL, &line, NULL, n_words);
+    if (n_words == 0) continue;
+    if (cs->hdr.n_lines + 2 > lines_cap) {
+      lines_cap *= 2;
+      cs->lines = realloc(cs->lines, sizeof *cs->lines * lines_cap);
+      if (!cs->lines) err(1, "realloc");
+    }
+    if (cs->hdr.n_tokens + n_words > tokens_cap) {
+      while (cs->hdr.n_tokens + n_words > tokens_cap) tokens_cap *= 2;
+      cs->tokens = realloc(cs->tokens, sizeof *cs->tokens * tokens_cap);
+      if (!cs->tokens) err(1, "realloc");
+    }
+    for (size_t i = 0; i < n_words; i++) {
+      size_t len = strlen(lexer.words[i].text) + 1;
+      if (cs->hdr.strtab_len + len > strtab_cap) {
+        while (cs->hdr.strtab_len + len > strtab_cap) strtab_cap *= 2;
+        cs->strtab = realloc(cs->strtab, strtab_cap);
+        if (!cs->strtab) err(1, "realloc");
+      }
+      cs->tokens[cs->hdr.n_tokens++] = (struct compiled_token) {
+        .type = lexer.words[i].type,
+        .expand = lexer.words[i].expand,
+        .text = cs->hdr.strtab_len,
+      };
+      memcpy(cs->strtab + cs->hdr.strtab_len, lexer.words[i].text, len);
+      cs->hdr.strtab_len += len;
+    }
+    cs->lines[++cs->hdr.n_lines] = cs->hdr.n_tokens;
+  }
+
+  cache_store(cs, path);
+  free(path);
+  return true;
+}
+
+/* Loads the next compiled line into words[].
+ *
+ * Returns the number of tokens, or -1 after the last line.
+ */
+ssize_t
+compiled_getline(struct compiled_script *cs) {
+  if (cs->next >= cs->hdr.n_lines) return -1;
+  uint32_t first = cs->lines[cs->next];
+  uint32_t n_words = cs->lines[++cs->next] - first;
+  words_reserve(&lexer, n_words);
+  for (uint32_t i = 0; i < n_words; i++) {
+    struct compiled_token const *ct = &cs->tokens[first + i];
+    lexer.words[i] = (struct token) {
+      .type = ct->type,
+      .expand = ct->expand,
+      .text = cs->strtab + ct->text, // read-only, nothing writes to words
+    };
+  }
+  return n_words;
+}
+
+/* Returns the path of name (which may contain printf conversions) under
+ * $SMALLSH_CACHE_DIR or ${XDG_CACHE_HOME:-$HOME/.cache}/smallsh, or
+ * NULL if there is nowhere to put it. The caller frees it.
+ */
+char *
+cache_path(char const *fmt, ...) {
+  char *name = NULL;
+  va_list ap;
+  va_start(ap, fmt);
+  int ret = vasprintf(&name, fmt, ap);
+  va_end(ap);
+  if (ret == -1) return NULL;
+
+  char const *dir = getenv("SMALLSH_CACHE_DIR");
+  char const *base = getenv("XDG_CACHE_HOME");
+  char const *home = getenv("HOME");
+  char *path = NULL;
+  if (dir && *dir) {
+    ret = asprintf(&path, "%s/%s", dir, name);
+  } else if (base && *base) {
+    ret = asprintf(&path, "%s/smallsh/%s", base, name);
+  } else if (home && *home) {
+    ret = asprintf(&path, "%s/.cache/smallsh/%s", home, name);
+  } else {
+    ret = -1;
+  }
+  free(name);
+  return ret == -1 ? NULL : path;
+}
+
+/* Checks the tables of a cache entry whose size has been checked
+ * against its header, so that compiled_getline() cannot be sent outside
+ * them by a corrupt file: line indexes must not go backwards or past the
+ * tokens, and every token must name a string in the string table, which
+ * must end in a NUL.
+ */
+bool
+cache_sane(struct cache_header const *hdr) {
+  uint32_t const *lines = (uint32_t const *) (hdr + 1);
+  struct compiled_token const *tokens =
+    (struct compiled_token const *) (lines + hdr->n_lines + 1);
+  char const *strtab = (char const *) (tokens + hdr->n_tokens);
+
+  for (uint32_t i = 0; i < hdr->n_lines; ++i) {
+    if (lines[i] > lines[i + 1]) return false;
+  }
+  if (lines[hdr->n_lines] > hdr->n_tokens) return false;
+  for (uint32_t i = 0; i < hdr->n_tokens; ++i) {
+    if (tokens[i].text >= hdr->strtab_len) return false;
+    if (tokens[i].type > TOK_HERESTR) return false;
+  }
+  return hdr->strtab_len == 0 || strtab[hdr->strtab_len - 1] == '\0';
+}
+
+/* Maps a cache file and checks that it was built from this script.
+ * Returns false if there is no usable entry.
+ */
+bool
+cache_load(struct compiled_script *cs, char const *path,
+           struct stat const *st, struct script_map const *m) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+  struct stat cst;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &cst) == 0 && (size_t) cst.st_size >= sizeof cs->hdr) {
+    map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  struct cache_header const *hdr = map;
+  uint64_t want = sizeof *hdr + sizeof *cs->lines * ((uint64_t) hdr->n_lines + 1)
+                + sizeof *cs->tokens * (uint64_t) hdr->n_tokens
+                + hdr->strtab_len;
+  bool ok = memcmp(hdr->magic, CACHE_MAGIC, sizeof hdr->magic) == 0
+         && hdr->version == CACHE_VERSION
+         && want == (uint64_t) cst.st_size
+         && cache_sane(hdr)
+         && hdr->size == (uint64_t) st->st_size;
+  bool stale = hdr->mtime_sec != st->st_mtim.tv_sec
+            || hdr->mtime_nsec != st->st_mtim.tv_nsec;
+  if (ok && stale) {
+    // touched but maybe not changed
+    ok = hdr->hash == fnv1a64(m->data, m->len);
+  }
+  if (!ok) {
+    dprintf("Cache entry %s is out of date\n", path);
+    munmap(map, cst.st_size);
+    return false;
+  }
+
+  *cs = (struct compiled_script) {
+    .hdr = *hdr,
+    .lines = (uint32_t *) (hdr + 1),
+    .map = map,
+    .map_len = cst.st_size,
+  };
+  cs->tokens = (struct compiled_token *) (cs->lines + hdr->n_lines + 1);
+  cs->strtab = (char *) (cs->tokens + hdr->n_tokens);
+  if (stale) {
+    cs->hdr.mtime_sec = st->st_mtim.tv_sec;
+    cs->hdr.mtime_nsec = st->st_mtim.tv_nsec;
+    cache_store(cs, path);
+  }
+  dprintf("Loaded %u compiled lines from %s\n", hdr->n_lines, path);
+  return true;
+}
+
+/* Writes a compiled script to its cache file. The file is written under
+ * a temporary name and renamed into place, so a concurrent run never
+ * sees half of it. Failing to cache is not an error.
+ */
+void
+cache_store(struct compiled_script const *cs, char const *path) {
+  char *tmp = NULL;
+  if (asprintf(&tmp, "%s.%jd", path, (intmax_t) getpid()) == -1) return;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1 && errno == ENOENT && mkdir_parents(tmp) == 0) {
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  }
+  if (fd == -1) {
+    free(tmp);
+    return;
+  }
+
+  struct iovec iov[] = {
+    { (void *) &cs->hdr, sizeof cs->hdr },
+    { cs->lines, sizeof *cs->lines * (cs->hdr.n_lines + 1) },
+    { cs->tokens, sizeof *cs->tokens * cs->hdr.n_tokens },
+    { cs->strtab, cs->hdr.strtab_len },
+  };
+  size_t total = 0;
+  for (size_t i = 0; i < sizeof iov / sizeof *iov; ++i) total += iov[i].iov_len;
+  bool ok = writev(fd, iov, sizeof iov / sizeof *iov) == (ssize_t) total;
+  if (close(fd) == -1) ok = false;
+  if (!ok || rename(tmp, path) == -1) unlink(tmp);
+  dprintf("Cached compiled script as %s: %s\n", path, ok ? "ok" : "failed");
+  free(tmp);
+}
+
+/* Creates the missing directories leading up to the file at path */
+int
+mkdir_parents(char *path) {
+  for (char *c = strchr(path + 1, '/'); c; c = strchr(c + 1, '/')) {
+    *c = '\0';
+    int ret = mkdir(path, 0700);
+    *c = '/';
+    if (ret == -1 && errno != EEXIST) return -1;
+  }
+  return 0;
+}
+
+/* 64-bit FNV-1a hash */
+uint64_t
+fnv1a64(void const *data, size_t len) {
+  uint64_t h = 14695981039346656037u;
+  for (unsigned char const *c = data; len--; ++c) h = (h ^ *c) * 1099511628211u;
+  return h;
+}
+
+/* Gives the shell's value of $c for c one of $ ! ?, or of ${name} */
+char const *
+param_value(struct parse_ctx *ctx, char c, char const *name, size_t len)
+{
+  switch (c) {
+  case '!':
+    // empty until a background process has been started
+    return last_bg_pid != 0 ? num_str(&last_bg_pid_str, last_bg_pid) : NULL;
+  case '$':
+    return shell_pid_str;
+  case '?':
+    return num_str(&last_status_str, last_status);
+  default:
+    return param_lookup(name, len);
+  }
+}
+
+/* Runs the command line text[0, len) of a $( ... ) and appends its
+ * output, less trailing newlines, to ctx's string. It is lexed and
+ * expanded with a context of its own. A pure built-in runs in the shell,
+ * writing to a memfd, so nothing forks and a long output cannot fill a
+ * pipe nobody reads yet; anything else is a pipeline whose output is
+ * read from a pipe as it comes.
+ */
+void
+substitute(struct parse_ctx *ctx, char const *text, size_t len)
+{
+  struct parse_ctx inner = {
+    .arena = ctx->arena, .lookup = ctx->lookup, .subst = ctx->subst,
+  };
+  size_t start_len = ctx->len;
+
+  char *line = memcpy(arena_alloc(&line_arena, len + 1), text, len);
+  line[len] = '\0';
+  size_t n_words = lex(&inner, line, false);
+  size_t n_cmds = 0;
+  bool bg = false; // a substitution is always waited on
+  struct command *cmds = NULL;
+  if (n_words > 0) cmds = parse_commands(inner.words, n_words, &n_cmds, &bg);
+  free(inner.words);
+
+  for (size_t i = 0; i < n_cmds; i++) {
+    if (cmds[i].argc == 0) {
+      errno = EINVAL; // empty pipeline stage
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      last_status = 2; // syntax error
+      return;
+    }
+  }
+
+  struct builtin const *bi = NULL;
+  if (n_cmds == 1) bi = builtin_find(cmds[0].argv[0]);
+  if (bi && bi->pure) {
+    int fd = memfd_create("smallsh-subst", MFD_CLOEXEC);
+    int saved_out = -1;
+    fflush(stdout);
+    if (fd == -1) {
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      return;
+    }
+    if (swap_fd(fcntl(fd, F_DUPFD_CLOEXEC, 0), STDOUT_FILENO,
+                &saved_out) == 0) {
+      run_builtin(bi, &cmds[0]);
+      fflush(stdout);
+    }
+    if (saved_out != -1) {
+      dup2(saved_out, STDOUT_FILENO);
+      close(saved_out);
+    }
+    lseek(fd, 0, SEEK_SET);
+    build_read(ctx, fd);
+    close(fd);
+  } else if (n_cmds > 0) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      return;
+    }
+    pid_t *pids = arena_alloc(&line_arena, sizeof *pids * n_cmds);
+    launch_pipeline(cmds, n_cmds, pids, pipe_fds[1]);
+    close(pipe_fds[1]);
+    build_read(ctx, pipe_fds[0]); // to EOF, so every stage can finish
+    close(pipe_fds[0]);
+    for (size_t i = 0; i < n_cmds; i++) {
+      int status;
+      if (pids[i] == -1) continue;
+      while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR);
+    }
+  }
+
+  while (ctx->len > start_len && ctx->base[ctx->len - 1] == '\n') {
+    ctx->base[--ctx->len] = '\0';
+  }
+}
+
+/* Turns tracing on, dumping to path at exit: Chrome trace-event JSON,
+ * or CSV if path ends in ".csv".
+ */
+void
+trace_open(char const *path) {
+  trace.ring = calloc(TRACE_RING, sizeof *trace.ring);
+  if (!trace.ring) err(1, "calloc");
+  size_t len = strlen(path);
+  trace.csv = len >= 4 && strcmp(path + len - 4, ".csv") == 0;
+  trace.path = path;
+  trace.owner = getpid();
+  trace.on = true;
+  atexit(trace_dump);
+}
+
+/* Returns the monotonic clock in nanoseconds, or 0 when not tracing */
+uint64_t
+trace_now(void) {
+  if (!trace.on) return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Records a phase that started at start (from trace_now()) and ends now.
+ * The ring keeps the latest TRACE_RING events.
+ */
+void
+trace_span(int phase, uint64_t start) {
+  if (!trace.on) return;
+  struct trace_event *ev = &trace.ring[trace.n_events++ % TRACE_RING];
+  *ev = (struct trace_event) {
+    .start = start,
+    .dur = trace_now() - start,
+    .phase = phase,
+  };
+}
+
+/* Writes out the ring at exit, from the shell only: a forked child that
+ * exits through here must not overwrite the dump.
+ */
+void
+trace_dump(void) {
+  static char const *const names[] = {
+    "getline", "wordsplit", "expand", "parse", "fork", "exec", "wait",
+  };
+  if (!trace.on || getpid() != trace.owner) return;
+  trace.on = false;
+
+  FILE *f = fopen(trace.path, "we");
+  if (!f) {
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    return;
+  }
+  size_t n = trace.n_events < TRACE_RING ? trace.n_events : TRACE_RING;
+  size_t first = trace.n_events - n;
+  if (trace.csv) {
+    fprintf(f, "phase,start_ns,dur_ns\n");
+  } else {
+    fprintf(f, "{\"traceEvents\":[\n");
+  }
+  for (size_t i = first; i < trace.n_events; ++i) {
+    struct trace_event const *ev = &trace.ring[i % TRACE_RING];
+    if (trace.csv) {
+      fprintf(f, "%s,%ju,%ju\n", names[ev->phase], (uintmax_t) ev->start,
+              (uintmax_t) ev->dur);
+    } else {
+      fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+              "\"dur\":%.3f,\"pid\":%jd,\"tid\":%jd}", i > first ? ",\n" : "",
+              names[ev->phase], ev->start / 1e3, ev->dur / 1e3,
+              (intmax_t) trace.owner, (intmax_t) trace.owner);
+    }
+  }
+  if (!trace.csv) {
+    fprintf(f, "\n],\"otherData\":{\"dropped\":%zu}}\n", first);
+  }
+  if (fclose(f) != 0) {
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+  }
+}
+
+void 
+sigint_handler(int sig) {
+  dprintf("\nsigint_handler called.\n");
+}
+
+void
+sigchld_handler(int sig) {
+  int saved_errno = errno;
+  sigchld_pending = 1;
+  (void) !write(sigchld_pipe[1], "", 1); // a full pipe already says enough
+  errno = saved_errno;
+}
+
+/* SIGCHLD: notes finished children, to be reaped at the prompt. Sets
+ * the handler and its self-pipe up the first time it is called, which
+ * has to be before the first child that is not waited on is started.
+ */
+void
+sigchld_setup(void) {
+  if (sigchld_pipe[0] != -1) return;
+  struct sigaction sigchld_act = {0};
+  if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) err(1, "pipe2");
+  sigchld_act.sa_handler = sigchld_handler;
+  sigfillset(&sigchld_act.sa_mask);
+  sigchld_act.sa_flags = SA_RESTART; // don't interrupt getline or waitpid
+  if (sigaction(SIGCHLD, &sigchld_act, NULL) == -1) {
+    dprintf("Signal handler failed on SIGCHLD\n");
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+  }
+}
+
+/* Adds a job for a copy of the given pipeline to the job table, in the
+ * queued state. Returns the new entry, valid until the table changes.
+ */
+struct job *
+job_new(struct command const *cmds, size_t n_cmds) {
+  sigchld_setup(); // its children are reaped when SIGCHLD says so
+  if (n_jobs == jobs_cap) {
+    jobs_cap = jobs_cap ? jobs_cap * 2 : 16;
+    void *tmp = realloc(jobs, sizeof *jobs * jobs_cap);
+    if (!tmp) err(1, "realloc");
+    jobs = tmp;
+  }
+  if (n_jobs == 0) next_job_id = 1;
+
+  struct job *job = &jobs[n_jobs++];
+  *job = (struct job) {
+    .id = next_job_id++,
+    .state = JOB_QUEUED,
+    .cmds = commands_dup(cmds, n_cmds),
+    .n_cmds = n_cmds,
+    .pids = n_cmds ? malloc(sizeof *job->pids * n_cmds) : NULL,
+    .pid = -1,
+    .out_fd = -1,
+  };
+  if (n_cmds && !job->pids) err(1, "malloc");
+  for (size_t i = 0; i < n_cmds; ++i) job->pids[i] = -1;
+  return job;
+}
+
+/* Hands a background pipeline to the scheduler, which starts it now if
+ * a slot is free and queues it otherwise.
+ */
+void
+job_submit(struct command const *cmds, size_t n_cmds) {
+  struct job *job = job_new(cmds, n_cmds);
+  dprintf("Job %d queued.\n", job->id);
+  if (group_get(current_group)) {
+    job->group = current_group;
+    ++group_get(current_group)->n_live;
+  }
+  schedule_jobs();
+}
+
+/* Starts a queued job, placed by $SMALLSH_CPUSET and $SMALLSH_CGROUP.
+ * A job none of whose stages started is done at once, with nothing to
+ * report.
+ */
+void
+job_start(struct job *job) {
+  struct placement place;
+  if (placement_next(&place)) placement = &place;
+  usage_start(&job->usage);
+  job->n_live = launch_pipeline(job->cmds, job->n_cmds, job->pids,
+                                job->out_fd);
+  placement = NULL;
+  job->pid = job->pids[job->n_cmds - 1];
+  if (job->n_live == 0) {
+    job->status = EXIT_FAILURE << 8; // as if it had exited 1
+    job_done(job);
+    return;
+  }
+  job->state = JOB_RUNNING;
+  if (job->pid != -1) last_bg_pid = job->pid;
+  dprintf("Job %d running in background.\n", job->id);
+}
+
+/* Picks the next job's placement from the environment, round-robin over
+ * the CPU sets. A CPU set that does not parse is reported and skipped.
+ *
+ * Returns whether there is anything to apply.
+ */
+bool
+placement_next(struct placement *p) {
+  char const *sets = getenv("SMALLSH_CPUSET");
+  char const *cgroup = getenv("SMALLSH_CGROUP");
+  *p = (struct placement) {
+    .cgroup = cgroup && *cgroup ? cgroup : NULL,
+  };
+
+  if (sets && *sets) {
+    size_t n_sets = 1;
+    for (char const *c = sets; *c; c++) n_sets += *c == ':';
+    char const *set = sets;
+    for (size_t i = next_cpuset++ % n_sets; i > 0; i--) {
+      set = strchr(set, ':') + 1;
+    }
+    p->pin = cpuset_parse(set, strcspn(set, ":"), &p->cpus);
+    if (!p->pin) {
+      errno = EINVAL; // not a CPU list
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    }
+  }
+  return p->pin || p->cgroup;
+}
+
+/* Parses a taskset-style CPU list, such as "0-3,8", of len characters */
+bool
+cpuset_parse(char const *list, size_t len, cpu_set_t *cpus) {
+  char const *end = list + len;
+  CPU_ZERO(cpus);
+  while (list < end) {
+    char *next;
+    if (!isdigit(*list)) return false;
+    unsigned long lo = strtoul(list, &next, 10), hi = lo;
+    if (next < end && *next == '-') {
+      if (!isdigit(next[1])) return false;
+      hi = strtoul(next + 1, &next, 10);
+    }
+    if (next > end || hi < lo || hi >= CPU_SETSIZE) return false;
+    for (unsigned long cpu = lo; cpu <= hi; cpu++) CPU_SET(cpu, cpus);
+    if (next < end && *next++ != ',') return false;
+    list = next;
+  }
+  return CPU_COUNT(cpus) > 0;
+}
+
+/* Moves the calling child to its placement: into the cgroup, by writing
+ * 0 (itself) to the cgroup's cgroup.procs, then onto the CPU set.
+ *
+ * Returns false after reporting the error.
+ */
+bool
+placement_apply(struct placement const *p) {
+  if (p->cgroup) {
+    char path[PATH_MAX];
+    int fd = -1;
+    if (snprintf(path, sizeof path, "%s/cgroup.procs", p->cgroup)
+        >= (int) sizeof path) {
+      errno = ENAMETOOLONG;
+    } else {
+      fd = open(path, O_WRONLY | O_CLOEXEC);
+    }
+    if (fd == -1 || write(fd, "0", 1) != 1) {
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      if (fd != -1) close(fd);
+      return false;
+    }
+    close(fd);
+  }
+  if (p->pin && sched_setaffinity(0, sizeof p->cpus, &p->cpus) == -1) {
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+/* Marks a job done, counting it off its group */
+void
+job_done(struct job *job) {
+  job->state = JOB_DONE;
+  usage_finish(&job->usage);
+  struct group *g = group_get(job->group);
+  if (g) {
+    int status = wait_status(job->status);
+    if (status > g->worst) g->worst = status;
+    --g->n_live;
+  }
+}
+
+/* Opens a new background group; returns its number. Finished groups
+ * beyond the newest GROUP_KEEP are dropped first, wherever they are in
+ * the table, so it only grows with the number of live groups.
+ */
+int
+group_new(void) {
+  size_t finished = 0, kept = groups_len;
+  for (size_t i = groups_len; i-- > 0;) {
+    if (groups[i].n_live > 0 || groups[i].id == current_group) continue;
+    if (++finished <= GROUP_KEEP) continue;
+    groups[i].id = 0; // dropped
+    --kept;
+  }
+  if (kept < groups_len) {
+    size_t j = 0;
+    for (size_t i = 0; i < groups_len; ++i) {
+      if (groups[i].id != 0) groups[j++] = groups[i];
+    }
+    groups_len = j;
+  }
+  if (kept == groups_cap) {
+    groups_cap = groups_cap ? groups_cap * 2 : 16;
+    void *tmp = realloc(groups, sizeof *groups * groups_cap);
+    if (!tmp) err(1, "realloc");
+    groups = tmp;
+  }
+  groups[groups_len++] = (struct group) { .id = ++n_groups };
+  return n_groups;
+}
+
+/* Looks a group up by number; NULL if there is none, or it was dropped */
+struct group *
+group_get(int id) {
+  size_t lo = 0, hi = groups_len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (groups[mid].id < id) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < groups_len && groups[lo].id == id ? &groups[lo] : NULL;
+}
+
+/* Waits until every job in a group is done. Returns the worst $? among
+ * them, or 0 for an empty or dropped group.
+ */
+int
+group_wait(int id) {
+  while (group_get(id) && group_get(id)->n_live > 0) reap_children(true);
+  return group_get(id) ? group_get(id)->worst : 0;
+}
+
+/* Turns a wait status into a $? value */
+int
+wait_status(int status) {
+  if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+  return WEXITSTATUS(status);
+}
+
+/* Starts queued jobs, oldest first, while there are free slots */
+void
+schedule_jobs(void) {
+  long running = 0;
+  for (size_t i = 0; i < n_jobs; ++i) {
+    if (jobs[i].state == JOB_RUNNING) ++running;
+  }
+  for (size_t i = 0; i < n_jobs; ++i) {
+    if (max_jobs > 0 && running >= max_jobs) break;
+    if (jobs[i].state != JOB_QUEUED) continue;
+    job_start(&jobs[i]);
+    if (jobs[i].state == JOB_RUNNING) ++running;
+  }
+}
+
+/* Drains the SIGCHLD self-pipe and reaps every child that has changed
+ * state since, recording finished ones in the job table, then lets the
+ * scheduler fill the freed slots. With block set, waits for at least one
+ * child first. Stopped background children are continued, as the prompt
+ * always did.
+ *
+ * Children are waited for whatever process group they have moved to.
+ * When there are none left at all, jobs still marked running can never
+ * be reaped, so they are marked done rather than waited on forever.
+ */
+void
+reap_children(bool block) {
+  char buf[64];
+  sigchld_pending = 0;
+  while (read(sigchld_pipe[0], buf, sizeof buf) > 0);
+
+  int bg_status = 0;
+  int options = WUNTRACED | (block ? 0 : WNOHANG);
+  pid_t bg_pid;
+  struct rusage ru;
+  while ((bg_pid = wait4(-1, &bg_status, options, &ru)) > 0) {
+    options |= WNOHANG;
+    if (WIFSTOPPED(bg_status)) {
+      fprintf(stderr, 
+      "Child process %jd stopped. Continuing.\n", 
+      (intmax_t) bg_pid);
+      kill(bg_pid, SIGCONT);
+      continue;
+    }
+
+    struct job *job = NULL;
+    for (size_t i = 0; i < n_jobs && !job; ++i) {
+      for (size_t j = 0; j < jobs[i].n_cmds; ++j) {
+        if (jobs[i].pids[j] == bg_pid) job = &jobs[i];
+      }
+    }
+    if (!job) {
+      // not started in the background, report it anyway
+      job = job_new(NULL, 0);
+      job->pid = bg_pid;
+      job->n_live = 1;
+      usage_start(&job->usage);
+    }
+    if (bg_pid == job->pid) job->status = bg_status;
+    usage_add(&job->usage, &ru);
+    if (--job->n_live == 0) job_done(job);
+  }
+  if (bg_pid == -1 && errno == ECHILD) {
+    for (size_t i = 0; i < n_jobs; ++i) {
+      if (jobs[i].state != JOB_RUNNING) continue;
+      dprintf("Job %d has no children left.\n", jobs[i].id);
+      jobs[i].n_live = 0;
+      job_done(&jobs[i]);
+    }
+  }
+  schedule_jobs();
+}
+
+/* Reports every finished job in one batch and drops it from the table.
+ * Returns how many there were.
+ */
+size_t
+report_jobs(void) {
+  size_t kept = 0;
+  for (size_t i = 0; i < n_jobs; ++i) {
+    if (jobs[i].state != JOB_DONE) {
+      jobs[kept++] = jobs[i];
+      continue;
+    }
+    if (jobs[i].quiet) {
+      free(jobs[i].cmds);
+      free(jobs[i].pids);
+      continue;
+    }
+    if (jobs[i].pid != -1 && WIFEXITED(jobs[i].status)) {
+      fprintf(stderr, 
+      "Child process %jd done. Exit status %d.\n", 
+      (intmax_t) jobs[i].pid, WEXITSTATUS(jobs[i].status));
+    }
+    if (jobs[i].pid != -1 && WIFSIGNALED(jobs[i].status)) {
+      fprintf(stderr, 
+      "Child process %jd done. Signaled %d.\n", 
+      (intmax_t) jobs[i].pid, WTERMSIG(jobs[i].status));
+    }
+    if (timing && jobs[i].pid != -1) {
+      fprintf(stderr, "Child process %jd timing: ", (intmax_t) jobs[i].pid);
+      print_usage(stderr, &jobs[i].usage);
+      fprintf(stderr, "\n");
+    }
+    free(jobs[i].cmds);
+    free(jobs[i].pids);
+  }
+  size_t n_done = n_jobs - kept;
+  n_jobs = kept;
+  return n_done;
+}
+
+/* Lists the job table: id, state, time since start and command */
+void
+print_jobs(void) {
+  static char const *const state_names[] = { "Queued", "Running", "Done" };
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  for (size_t i = 0; i < n_jobs; ++i) {
+    struct job const *job = &jobs[i];
+    double elapsed = 0;
+    if (job->state != JOB_QUEUED) {
+      elapsed = (now.tv_sec - job->usage.start.tv_sec) 
+              + (now.tv_nsec - job->usage.start.tv_nsec) / 1e9;
+    }
+    printf("[%d] %-8s %8.1fs", job->id, state_names[job->state], elapsed);
+    for (size_t j = 0; j < job->n_cmds; ++j) {
+      struct command const *cmd = &job->cmds[j];
+      if (j > 0) printf(" |");
+      for (int k = 0; k < cmd->argc; ++k) printf(" %s", cmd->argv[k]);
+      if (cmd->read) printf(" < %s", cmd->read);
+      if (cmd->write) printf(" > %s", cmd->write);
+      if (cmd->append) printf(" >> %s", cmd->append);
+      if (cmd->here) printf(" <<(%zu bytes)", strlen(cmd->here));
+    }
+    if (job->n_cmds == 0) printf(" (pid %jd)", (intmax_t) job->pid);
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+/* Finds a job by "%id" or by the pid of one of its stages */
+struct job *
+job_find(char const *spec) {
+  char *end;
+  long n = strtol(spec + (*spec == '%'), &end, 10);
+  if (*end != '\0' || end == spec + (*spec == '%')) return NULL;
+  for (size_t i = 0; i < n_jobs; ++i) {
+    if (*spec == '%' && jobs[i].id == n) return &jobs[i];
+    for (size_t j = 0; *spec != '%' && j < jobs[i].n_cmds; ++j) {
+      if (jobs[i].pids[j] == n) return &jobs[i];
+    }
+  }
+  return NULL;
+}
+
+/* Built-in wait: with no arguments waits until every job, including
+ * queued ones, is done; otherwise waits on each "%id", pid, or "%gN"
+ * group ("%g" for the latest) in turn.
+ *
+ * Returns the $? value: that of the last job waited on by name (the
+ * worst in a group), or 0.
+ */
+int
+wait_jobs(char *specs[], int n_specs) {
+  int ret = 0;
+  if (n_specs == 0) {
+    for (;;) {
+      size_t i = 0;
+      for (; i < n_jobs && jobs[i].state == JOB_DONE; ++i);
+      if (i == n_jobs) break;
+      reap_children(true);
+    }
+    return ret;
+  }
+
+  for (int i = 0; i < n_specs; ++i) {
+    if (strncmp(specs[i], "%g", 2) == 0) {
+      char *end;
+      long id = specs[i][2] ? strtol(specs[i] + 2, &end, 10) : (long) n_groups;
+      if ((specs[i][2] && *end != '\0') || !group_get(id)) {
+        errno = ECHILD; // no such group
+        fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+        ret = 127;
+      } else {
+        ret = group_wait(id);
+      }
+      continue;
+    }
+
+    struct job *job = job_find(specs[i]);
+    if (!job) {
+      errno = ECHILD; // no such job
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      ret = 127;
+      continue;
+    }
+    int id = job->id;
+    while (job->state != JOB_DONE) {
+      reap_children(true);
+      for (size_t j = 0; j < n_jobs; ++j) {
+        if (jobs[j].id == id) job = &jobs[j]; // table may have moved
+      }
+    }
+    ret = wait_status(job->status);
+  }
+  return ret;
+}
+
+/* Starts measuring a line or job: clears its totals and notes the time */
+void
+usage_start(struct usage *u) {
+  *u = (struct usage) {0};
+  clock_gettime(CLOCK_MONOTONIC, &u->start);
+}
+
+/* Adds a reaped child's rusage from wait4() to the totals. CPU times
+ * add up across stages; max RSS is the largest of any stage.
+ */
+void
+usage_add(struct usage *u, struct rusage const *ru) {
+  timeradd(&u->ru.ru_utime, &ru->ru_utime, &u->ru.ru_utime);
+  timeradd(&u->ru.ru_stime, &ru->ru_stime, &u->ru.ru_stime);
+  if (ru->ru_maxrss > u->ru.ru_maxrss) u->ru.ru_maxrss = ru->ru_maxrss;
+}
+
+/* Records the wall time since usage_start() */
+void
+usage_finish(struct usage *u) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  u->wall = (now.tv_sec - u->start.tv_sec) 
+          + (now.tv_nsec - u->start.tv_nsec) / 1e9;
+}
+
+void
+print_usage(FILE *f, struct usage const *u) {
+  fprintf(f, "real %.6fs user %.6fs sys %.6fs maxrss %ldKiB", u->wall,
+          u->ru.ru_utime.tv_sec + u->ru.ru_utime.tv_usec / 1e6,
+          u->ru.ru_stime.tv_sec + u->ru.ru_stime.tv_usec / 1e6,
+          u->ru.ru_maxrss);
+}
+
+/* Built-in times: the last command's usage, then the CPU time used by
+ * the shell itself and by all the children it has reaped.
+ */
+void
+print_times(void) {
+  struct rusage self, children;
+  getrusage(RUSAGE_SELF, &self);
+  getrusage(RUSAGE_CHILDREN, &children);
+
+  printf("last:     ");
+  print_usage(stdout, &last_usage);
+  printf("\nshell:    user %.6fs sys %.6fs\n",
+         self.ru_utime.tv_sec + self.ru_utime.tv_usec / 1e6,
+         self.ru_stime.tv_sec + self.ru_stime.tv_usec / 1e6);
+  printf("children: user %.6fs sys %.6fs\n",
+         children.ru_utime.tv_sec + children.ru_utime.tv_usec / 1e6,
+         children.ru_stime.tv_sec + children.ru_stime.tv_usec / 1e6);
+  fflush(stdout);
+}
+
+/* Copies a pipeline, with all its argv arrays and strings, into a single
+ * allocation that the caller frees with one free().
+ */
+struct command *
+commands_dup(struct command const *cmds, size_t n_cmds) {
+  size_t size = sizeof *cmds * n_cmds;
+  for (size_t i = 0; i < n_cmds; ++i) {
+    size += sizeof *cmds[i].argv * (cmds[i].argc + 1);
+    for (int j = 0; j < cmds[i].argc; ++j) size += strlen(cmds[i].argv[j]) + 1;
+    if (cmds[i].read) size += strlen(cmds[i].read) + 1;
+    if (cmds[i].write) size += strlen(cmds[i].write) + 1;
+    if (cmds[i].append) size += strlen(cmds[i].append) + 1;
+    if (cmds[i].here) size += strlen(cmds[i].here) + 1;
+  }
+  if (size == 0) return NULL;
+
+  struct command *copy = malloc(size);
+  if (!copy) err(1, "malloc");
+  char **argv = (char **) (copy + n_cmds);
+  for (size_t i = 0; i < n_cmds; ++i) argv += cmds[i].argc + 1;
+  char *str = (char *) argv;
+  argv = (char **) (copy + n_cmds);
+
+  #define DUP_STR(dst, src) \
+    do { \
+      size_t n = strlen(src) + 1; \
+      dst = memcpy(str, src, n); \
+      str += n; \
+    } while (0)
+  for (size_t i = 0; i < n_cmds; ++i) {
+    copy[i] = (struct command) { .argv = argv, .argc = cmds[i].argc };
+    for (int j = 0; j < cmds[i].argc; ++j) DUP_STR(argv[j], cmds[i].argv[j]);
+    argv[cmds[i].argc] = NULL;
+    argv += cmds[i].argc + 1;
+    if (cmds[i].read) DUP_STR(copy[i].read, cmds[i].read);
+    if (cmds[i].write) DUP_STR(copy[i].write, cmds[i].write);
+    if (cmds[i].append) DUP_STR(copy[i].append, cmds[i].append);
+    if (cmds[i].here) DUP_STR(copy[i].here, cmds[i].here);
+  }
+  #undef DUP_STR
+  return copy;
+}
+
+/* Returns value as a decimal string, reformatting it only when it
+ * differs from the one the cache last saw.
+ */
+char const *
+num_str(struct num_str *cache, int value) {
+  if (!cache->valid || cache->value != value) {
+    snprintf(cache->str, sizeof cache->str, "%d", value);
+    cache->value = value;
+    cache->valid = true;
+  }
+  return cache->str;
+}
+
+/* Looks up the environment variable named by the len bytes at name,
+ * memoizing the result until env_set() reports a change.
+ *
+ * Returns the value, or NULL if it is unset.
+ */
+char const *
+param_lookup(char const *name, size_t len) {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < len; ++i) h = (h ^ (unsigned char) name[i]) * 16777619u;
+  struct param_entry *e = &param_cache[h % PARAM_CACHE_SIZE];
+
+  if (e->gen == env_generation && strncmp(e->name, name, len) == 0
+  && e->name[len] == '\0') {
+    return e->value;
+  }
+
+  free(e->name);
+  e->name = strndup(name, len);
+  if (!e->name) err(1, "strndup");
+  e->value = getenv(e->name);
+  e->gen = env_generation;
+  dprintf("Cached ${%s} = %s\n", e->name, e->value ? e->value : "(unset)");
+  return e->value;
+}
+
+/* Sets (or with a NULL value, unsets) an environment variable. Every
+ * change to the environment goes through here so that the ${name}
+ * cache can be invalidated.
+ */
+int
+env_set(char const *name, char const *value) {
+  ++env_generation;
+  return value ? setenv(name, value, 1) : unsetenv(name);
+}
+
+/* The open_* functions open a redirection target close-on-exec.
+ * They return the descriptor, or -1 after reporting the error.
+ */
+int
+open_read(char * read) {
+  int input = open(read, O_RDONLY | O_CLOEXEC);
+  if (input != -1) {
+    dprintf("Input stream set to %s\n", read);
+  } else {
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+  }
+  return input;
+}
+
+int
+open_write(char *write) {
+  int output = open(write, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0777);
+  if (output != -1) {
+    dprintf("Output stream set to %s\n", write);
+  } else {
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+  }
+  return output;
+}
+
+int
+open_append(char *append) {
+  int output = open(append, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0777);
+  if (output != -1) {
+    dprintf("Output stream set to %s\n", append);
+  } else {
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+  }
+  return output;
+}
+
+/* Returns a descriptor to read a here-document's text from, without
+ * touching the disk: a pipe it is written into when it fits the pipe's
+ * atomic size, a memfd otherwise. Returns -1 after reporting the error.
+ */
+int
+open_here(char *text) {
+  size_t len = strlen(text);
+  int fd = -1;
+  if (len <= PIPE_BUF) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == 0) {
+      if (write(fds[1], text, len) == (ssize_t) len) fd = fds[0];
+      else close(fds[0]);
+      close(fds[1]);
+    }
+  } else {
+    fd = memfd_create("smallsh-heredoc", MFD_CLOEXEC);
+    if (fd != -1) {
+      size_t done = 0;
+      while (done < len) {
+        ssize_t ret = write(fd, text + done, len - done);
+        if (ret == -1 && errno == EINTR) continue;
+        if (ret == -1) break;
+        done += ret;
+      }
+      if (done < len || lseek(fd, 0, SEEK_SET) == -1) {
+        close(fd);
+        fd = -1;
+      }
+    }
+  }
+  if (fd == -1) fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+  return fd;
+}
+
+/* Opens a command's redirection targets, once each and close-on-exec,
+ * into a plan of what its stdin and stdout will be: a redirection wins
+ * over the in_fd/out_fd pipe ends (-1 for none), '>' over '>>' and a
+ * here-document over '<'. The
+ * child only has to dup2 the plan into place.
+ *
+ * Returns false after reporting the error, with nothing left open.
+ */
+bool
+fd_plan_open(struct fd_plan *plan, struct command const *cmd,
+             int in_fd, int out_fd) {
+  *plan = (struct fd_plan) { .in = in_fd, .out = out_fd };
+  char *targets[] = { cmd->append, cmd->write, cmd->read, cmd->here };
+  int (*const opens[])(char *) = {
+    open_append, open_write, open_read, open_here
+  };
+  for (size_t i = 0; i < 4; ++i) {
+    if (targets[i] == NULL) continue;
+    int fd = opens[i](targets[i]);
+    if (fd == -1) {
+      fd_plan_close(plan);
+      return false;
+    }
+    plan->opened[plan->n_opened++] = fd;
+    if (i >= 2) plan->in = fd;
+    else plan->out = fd;
+  }
+  return true;
+}
+
+/* Closes the descriptors a plan opened, once the child has its copies */
+void
+fd_plan_close(struct fd_plan *plan) {
+  for (size_t i = 0; i < plan->n_opened; ++i) close(plan->opened[i]);
+  plan->n_opened = 0;
+}
+
+/* Puts a plan into place in a forked child; failing exits */
+void
+fd_plan_apply(struct fd_plan const *plan) {
+  if ((plan->in != -1 && dup2(plan->in, STDIN_FILENO) == -1)
+  || (plan->out != -1 && dup2(plan->out, STDOUT_FILENO) == -1)) {
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Copies everything from in_fd to out_fd without moving the data through
+ * user space where possible: copy_file_range(2) first (which can share
+ * extents on filesystems that support it), then splice(2) through a pipe,
+ * and plain read/write only if neither works for these descriptors.
+ *
+ * Returns 0 on success, or -1 with errno set.
+ */
+int
+copy_fd(int in_fd, int out_fd) {
+  ssize_t n;
+  bool moved = false;
+
+  while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0)) > 0) {
+    moved = true;
+  }
+  if (n == 0) return 0;
+  if (moved || (errno != EXDEV && errno != EINVAL && errno != EBADF
+  && errno != ENOSYS && errno != EOPNOTSUPP)) {
+    return -1;
+  }
+  dprintf("copy_file_range unsupported, trying splice\n");
+
+  char buf[1 << 16];
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) != -1) {
+    bool stuck = false;
+    while (!stuck && (n = splice(in_fd, NULL, pipe_fds[1], NULL, COPY_CHUNK,
+                                 SPLICE_F_MOVE)) > 0) {
+      moved = true;
+      while (n > 0) {
+        ssize_t m = splice(pipe_fds[0], NULL, out_fd, NULL, n, SPLICE_F_MOVE);
+        if (m <= 0) {
+          // e.g. O_APPEND targets: hand what's in the pipe to write()
+          stuck = true;
+          close(pipe_fds[1]);
+          while ((m = read(pipe_fds[0], buf, sizeof buf)) > 0) {
+            if (write(out_fd, buf, m) != m) {
+              close(pipe_fds[0]);
+              return -1;
+            }
+          }
+          break;
+        }
+        n -= m;
+      }
+    }
+    int saved_errno = errno;
+    close(pipe_fds[0]);
+    if (!stuck) close(pipe_fds[1]);
+    errno = saved_errno;
+    if (!stuck) {
+      if (n == 0) return 0;
+      if (moved || errno != EINVAL) return -1;
+    }
+  }
+  dprintf("splice unsupported, copying through user space\n");
+
+  while ((n = read(in_fd, buf, sizeof buf)) > 0) {
+    for (char *p = buf; n > 0;) {
+      ssize_t m = write(out_fd, p, n);
+      if (m == -1) return -1;
+      p += m;
+      n -= m;
+    }
+  }
+  return n == 0 ? 0 : -1;
+}
+
+/* Looks a command up in the hash table, searching $PATH and remembering
+ * the result on a miss. Names containing a '/' are used as-is. The table
+ * is flushed when $PATH changes, and an entry is dropped when its file is
+ * no longer executable.
+ *
+ * Returns the resolved path (owned by the table), or NULL with errno set
+ * if the command was not found.
+ */
+char *
+hash_lookup(char const *name) {
+  if (strchr(name, '/') != NULL) return (char *) name;
+
+  char const *path_env = param_lookup("PATH", 4);
+  if (path_env == NULL) path_env = "/bin:/usr/bin"; // execvp's default
+  if (cmd_hash_path == NULL || strcmp(cmd_hash_path, path_env) != 0) {
+    dprintf("PATH changed, flushing hash table\n");
+    hash_reset();
+    cmd_hash_path = strdup(path_env);
+    if (!cmd_hash_path) err(1, "strdup");
+  }
+
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (char const *c = name; *c; ++c) h = (h ^ (unsigned char) *c) * 16777619u;
+  struct hash_entry **slot = &cmd_hash[h % HASH_SIZE];
+
+  for (struct hash_entry **e = slot; *e; e = &(*e)->next) {
+    if (strcmp((*e)->name, name) != 0) continue;
+    if (access((*e)->path, X_OK) == 0) {
+      (*e)->hits++;
+      return (*e)->path;
+    }
+    // Stale entry, forget it and search again
+    dprintf("Hashed path %s is gone\n", (*e)->path);
+    struct hash_entry *stale = *e;
+    *e = stale->next;
+    free(stale->name);
+    free(stale->path);
+    free(stale);
+    break;
+  }
+
+  // Search each $PATH entry, an empty one meaning the current directory
+  size_t name_len = strlen(name);
+  for (char const *dir = path_env;; ++dir) {
+    char const *dir_end = strchrnul(dir, ':');
+    size_t dir_len = dir_end - dir;
+    char *candidate = malloc(dir_len + name_len + 3);
+    if (!candidate) err(1, "malloc");
+    if (dir_len == 0) {
+      candidate[0] = '.';
+      dir_len = 1;
+    } else {
+      memcpy(candidate, dir, dir_len);
+    }
+    candidate[dir_len] = '/';
+    memcpy(candidate + dir_len + 1, name, name_len + 1);
+
+    struct stat st;
+    if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) 
+    && access(candidate, X_OK) == 0) {
+      struct hash_entry *e = malloc(sizeof *e);
+      if (!e) err(1, "malloc");
+      e->name = strdup(name);
+      if (!e->name) err(1, "strdup");
+      e->path = candidate;
+      e->hits = 1;
+      e->next = *slot;
+      *slot = e;
+      dprintf("Hashed %s -> %s\n", name, candidate);
+      return candidate;
+    }
+    free(candidate);
+    if (*dir_end == '\0') break;
+    dir = dir_end;
+  }
+  errno = ENOENT;
+  return NULL;
+}
+
+/* Empties the command hash table */
+void
+hash_reset(void) {
+  for (size_t i = 0; i < HASH_SIZE; ++i) {
+    while (cmd_hash[i]) {
+      struct hash_entry *e = cmd_hash[i];
+      cmd_hash[i] = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+    }
+  }
+  free(cmd_hash_path);
+  cmd_hash_path = NULL;
+}
+
+/* Prints the command hash table in the same format as bash */
+void
+hash_print(void) {
+  bool empty = true;
+  for (size_t i = 0; i < HASH_SIZE; ++i) {
+    for (struct hash_entry *e = cmd_hash[i]; e; e = e->next) {
+      if (empty) printf("hits\tcommand\n");
+      empty = false;
+      printf("%4u\t%s\n", e->hits, e->path);
+    }
+  }
+  if (empty) fprintf(stderr, "hash: hash table empty\n");
+  fflush(stdout);
+}
+
+/* Looks up a built-in command by name. Returns NULL if there is none. */
+struct builtin const *
+builtin_find(char const *name) {
+  for (size_t i = 0; i < sizeof builtins / sizeof *builtins; ++i) {
+    if (strcmp(builtins[i].name, name) == 0) return &builtins[i];
+  }
+  return NULL;
+}
+
+/* Points target at fd for as long as an in-process built-in runs, saving
+ * the original in *saved the first time. The shell's own stdin keeps its
+ * buffered input, since built-ins never read from it.
+ *
+ * Returns -1 after reporting the error.
+ */
+int
+swap_fd(int fd, int target, int *saved) {
+  if (fd == -1) return -1;
+  if (*saved == -1) *saved = fcntl(target, F_DUPFD_CLOEXEC, 10);
+  if (*saved == -1 || dup2(fd, target) == -1) {
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+/* Runs a built-in inside the shell, with the command's redirections
+ * applied by swapping stdin/stdout around the call, in the same order
+ * the fork path applies them.
+ *
+ * Returns the $? value.
+ */
+int
+run_builtin(struct builtin const *bi, struct command const *cmd) {
+  int saved_in = -1, saved_out = -1;
+  int ret = EXIT_FAILURE;
+
+  fflush(stdout);
+  if ((cmd->append == NULL
+       || swap_fd(open_append(cmd->append), STDOUT_FILENO, &saved_out) == 0)
+  && (cmd->write == NULL
+      || swap_fd(open_write(cmd->write), STDOUT_FILENO, &saved_out) == 0)
+  && (cmd->read == NULL
+      || swap_fd(open_read(cmd->read), STDIN_FILENO, &saved_in) == 0)
+  && (cmd->here == NULL
+      || swap_fd(open_here(cmd->here), STDIN_FILENO, &saved_in) == 0)) {
+    ret = bi->fn(cmd->argc, cmd->argv);
+  }
+  fflush(stdout);
+
+  // Put the shell's own descriptors back
+  if (saved_out != -1) {
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_out);
+  }
+  if (saved_in != -1) {
+    dup2(saved_in, STDIN_FILENO);
+    close(saved_in);
+  }
+  return ret;
+}
+
+/* Built-in exit command */
+int
+builtin_exit(int argc, char *argv[]) {
+  if (argc >= 3) {
+    errno = E2BIG; // Too many arguments
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    return EXIT_FAILURE;
+  } else if (argc == 2) {
+    if (!isdigit(*argv[1])) {
+      errno = EINVAL; // Argument is not an integer
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    dprintf("Exit code: %s\n", argv[1]);
+    exit(atoi(argv[1]));  // Exit with argument
+  }
+  dprintf("Default exit: %d\n", last_status);
+  exit(last_status);
+}
+
+/* Built-in change dir command: to the argument, or to $HOME */
+int
+builtin_cd(int argc, char *argv[]) {
+  char const *dir;
+  if (argc >= 3) {
+    errno = E2BIG; // too many arguments
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    return EXIT_FAILURE;
+  } else if (argc == 2) {
+    dir = argv[1];
+    if (access(dir, F_OK) == -1) {
+      errno = ENOTDIR; // not a directory
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  } else {
+    dir = param_lookup("HOME", 4);
+    if (!dir) dir = "";
+  }
+
+  dprintf("Changing directory to: %s\n", dir);
+  if (chdir(dir) != 0) {
+    errno = ENOENT; // chdir failed
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+#ifdef DEBUG
+  char *cwd = getcwd(NULL, 0);
+  dprintf("New directory is %s\n", cwd);
+  free(cwd);
+#endif
+
+  return EXIT_SUCCESS;
+}
+
+/* Built-in command hash table: list it, empty it (-r) or add commands */
+int
+builtin_hash(int argc, char *argv[]) {
+  int ret = EXIT_SUCCESS;
+  if (argc == 1) {
+    hash_print();
+  } else if (strcmp(argv[1], "-r") == 0) {
+    hash_reset();
+  } else {
+    for (int j = 1; j < argc; j++) {
+      if (hash_lookup(argv[j]) == NULL) {
+        fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+        ret = EXIT_FAILURE;
+      }
+    }
+  }
+  return ret;
+}
+
+/* Built-in job listing */
+int
+builtin_jobs(int argc, char *argv[]) {
+  print_jobs();
+  return EXIT_SUCCESS;
+}
+
+/* Built-in wait for background jobs */
+int
+builtin_wait(int argc, char *argv[]) {
+  int ret = wait_jobs(argv + 1, argc - 1);
+  report_jobs();
+  return ret;
+}
+
+/* Built-in resource usage report */
+int
+builtin_times(int argc, char *argv[]) {
+  print_times();
+  return EXIT_SUCCESS;
+}
+
+/* Built-in memstat: what the shell itself holds on to. The line arena
+ * is reset after every command, so its high-water mark and the longest
+ * line seen bound the shell's memory, apart from the job and hash tables.
+ */
+int
+builtin_memstat(int argc, char *argv[]) {
+  size_t n_chunks = 0, arena_cap = 0;
+  for (struct arena_chunk *c = line_arena.head; c; c = c->prev) {
+    ++n_chunks;
+    arena_cap += c->cap;
+  }
+  size_t n_hashed = 0;
+  for (size_t i = 0; i < HASH_SIZE; ++i) {
+    for (struct hash_entry *e = cmd_hash[i]; e; e = e->next) ++n_hashed;
+  }
+  struct rusage self;
+  getrusage(RUSAGE_SELF, &self);
+  long pages = 0;
+  FILE *statm = fopen("/proc/self/statm", "re");
+  if (statm) {
+    if (fscanf(statm, "%*s %ld", &pages) != 1) pages = 0;
+    fclose(statm);
+  }
+
+  printf("arena:    used %zu high-water %zu in %zu chunks of %zu bytes\n",
+         line_arena.used, line_arena.high_water, n_chunks, arena_cap);
+  printf("words:    %zu slots, %zu bytes\n",
+         lexer.words_cap, lexer.words_cap * sizeof *lexer.words);
+  printf("input:    %zu bytes buffered\n", stdin_reader.cap);
+  printf("jobs:     %zu of %zu slots\n", n_jobs, jobs_cap);
+  printf("groups:   %zu of %zu slots\n", groups_len, groups_cap);
+  printf("hash:     %zu commands\n", n_hashed);
+  printf("rss:      %ld kB, max %ld kB\n",
+         pages * (sysconf(_SC_PAGESIZE) / 1024), self.ru_maxrss);
+  fflush(stdout);
+  return EXIT_SUCCESS;
+}
+
+int
+builtin_true(int argc, char *argv[]) {
+  return EXIT_SUCCESS;
+}
+
+int
+builtin_false(int argc, char *argv[]) {
+  return EXIT_FAILURE;
+}
+
+/* Built-in echo: the arguments separated by spaces, then a newline
+ * unless the first argument is -n
+ */
+int
+builtin_echo(int argc, char *argv[]) {
+  bool newline = !(argc > 1 && strcmp(argv[1], "-n") == 0);
+  for (int i = newline ? 1 : 2; i < argc; ++i) {
+    if (i > (newline ? 1 : 2)) putchar(' ');
+    fputs(argv[i], stdout);
+  }
+  if (newline) putchar('\n');
+  return ferror(stdout) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Prints the backslash escape at c (just past the backslash) for printf,
+ * returning the last character used.
+ */
+char const *
+print_escape(char const *c) {
+  static char const from[] = "abfnrtv\\\"";
+  static char const to[] = "\a\b\f\n\r\t\v\\\"";
+  char const *e = *c ? strchr(from, *c) : NULL;
+  if (e) {
+    putchar(to[e - from]);
+  } else if (*c >= '0' && *c <= '7') {
+    int value = 0;
+    for (int i = 0; i < 3 && *c >= '0' && *c <= '7'; ++i) {
+      value = value * 8 + *c++ - '0';
+    }
+    putchar(value);
+    --c;
+  } else {
+    putchar('\\');
+    if (!*c) return c - 1;
+    putchar(*c);
+  }
+  return c;
+}
+
+/* Built-in printf: the format's %s, %b, %c, %d, %i, %u, %o, %x and %X
+ * conversions (with flags, width and precision) and backslash escapes.
+ * The format is reused until the arguments run out; missing ones count
+ * as "" or 0.
+ */
+int
+builtin_printf(int argc, char *argv[]) {
+  if (argc < 2) {
+    errno = EINVAL; // no format
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    return 2;
+  }
+  char const *fmt = argv[1];
+  int arg = 2;
+  int ret = EXIT_SUCCESS;
+
+  do {
+    int first = arg;
+    for (char const *c = fmt; *c; ++c) {
+      if (*c == '\\') {
+        c = print_escape(c + 1);
+        continue;
+      } else if (*c != '%') {
+        putchar(*c);
+        continue;
+      } else if (c[1] == '%') {
+        putchar(*++c);
+        continue;
+      }
+
+      // Copy the conversion spec, leaving room for the "ll" length
+      char spec[32] = "%";
+      size_t len = 1;
+      size_t n = strspn(c + 1, "-+ #0");
+      n += strspn(c + 1 + n, "0123456789");
+      if (c[1 + n] == '.') n += 1 + strspn(c + 2 + n, "0123456789");
+      if (n > sizeof spec - 5) n = sizeof spec - 5;
+      memcpy(spec + len, c + 1, n);
+      len += n;
+      c += n + 1;
+      char const *value = arg < argc ? argv[arg++] : "";
+
+      char *end = NULL;
+      switch (*c) {
+      case 's':
+        strcpy(spec + len, "s");
+        printf(spec, value);
+        break;
+      case 'b':
+        for (char const *v = value; *v; ++v) {
+          if (*v == '\\') v = print_escape(v + 1);
+          else putchar(*v);
+        }
+        break;
+      case 'c':
+        if (*value) putchar(*value);
+        break;
+      case 'd':
+      case 'i':
+        errno = 0;
+        long long sval = *value ? strtoll(value, &end, 0) : 0;
+        strcpy(spec + len, "lld");
+        printf(spec, sval);
+        break;
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+        errno = 0;
+        unsigned long long uval = *value ? strtoull(value, &end, 0) : 0;
+        spec[len] = 'l';
+        spec[len + 1] = 'l';
+        spec[len + 2] = *c;
+        printf(spec, uval);
+        break;
+      default:
+        errno = EINVAL; // unknown conversion
+        fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+        return EXIT_FAILURE;
+      }
+      if (end && (*end != '\0' || errno)) {
+        if (!errno) errno = EINVAL; // not a number
+        fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+        ret = EXIT_FAILURE;
+      }
+    }
+    if (arg == first) break; // format took no arguments
+  } while (arg < argc);
+  return ferror(stdout) ? EXIT_FAILURE : ret;
+}
+
+/* Parses an integer operand for test, reporting bad ones */
+bool
+test_int(char const *s, long long *value) {
+  char *end;
+  errno = 0;
+  *value = strtoll(s, &end, 10);
+  if (end == s || *end != '\0' || errno) {
+    if (!errno) errno = EINVAL; // not an integer
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+/* Negates a test result, passing errors through */
+int
+test_not(int ret) {
+  return ret == 2 ? ret : !ret;
+}
+
+/* Evaluates a test expression of up to four arguments by the POSIX rules
+ * on argument counts. Returns 0 for true, 1 for false or 2 on error.
+ */
+int
+test_eval(int argc, char *argv[]) {
+  struct stat st;
+  switch (argc) {
+  case 0:
+    return 1;
+  case 1:
+    return *argv[0] == '\0';
+  case 2:
+    if (strcmp(argv[0], "!") == 0) return !test_eval(1, argv + 1);
+    if (argv[0][0] != '-' || argv[0][1] == '\0' || argv[0][2] != '\0') break;
+    switch (argv[0][1]) {
+    case 'n': return *argv[1] == '\0';
+    case 'z': return *argv[1] != '\0';
+    case 'r': return access(argv[1], R_OK) != 0;
+    case 'w': return access(argv[1], W_OK) != 0;
+    case 'x': return access(argv[1], X_OK) != 0;
+    case 'h':
+    case 'L': return lstat(argv[1], &st) != 0 || !S_ISLNK(st.st_mode);
+    }
+    if (strchr("efdsbcpS", argv[0][1]) == NULL) break;
+    if (stat(argv[1], &st) != 0) return 1;
+    switch (argv[0][1]) {
+    case 'e': return 0;
+    case 'f': return !S_ISREG(st.st_mode);
+    case 'd': return !S_ISDIR(st.st_mode);
+    case 's': return st.st_size == 0;
+    case 'b': return !S_ISBLK(st.st_mode);
+    case 'c': return !S_ISCHR(st.st_mode);
+    case 'p': return !S_ISFIFO(st.st_mode);
+    case 'S': return !S_ISSOCK(st.st_mode);
+    }
+    break;
+  case 3: {
+    char const *op = argv[1];
+    if (strcmp(op, "=") == 0) return strcmp(argv[0], argv[2]) != 0;
+    if (strcmp(op, "!=") == 0) return strcmp(argv[0], argv[2]) == 0;
+    static char const *const int_ops[] = {
+      "-eq", "-ne", "-lt", "-le", "-gt", "-ge"
+    };
+    for (int i = 0; i < 6; ++i) {
+      if (strcmp(op, int_ops[i]) != 0) continue;
+      long long a, b;
+      if (!test_int(argv[0], &a) || !test_int(argv[2], &b)) return 2;
+      bool result[] = { a == b, a != b, a < b, a <= b, a > b, a >= b };
+      return !result[i];
+    }
+    if (strcmp(argv[0], "!") == 0) return test_not(test_eval(2, argv + 1));
+    break;
+  }
+  case 4:
+    if (strcmp(argv[0], "!") == 0) return test_not(test_eval(3, argv + 1));
+    break;
+  }
+  errno = EINVAL; // unsupported expression
+  fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+  return 2;
+}
+
+/* Built-in test and [ */
+int
+builtin_test(int argc, char *argv[]) {
+  if (strcmp(argv[0], "[") == 0) {
+    if (strcmp(argv[argc - 1], "]") != 0) {
+      errno = EINVAL; // missing ]
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      return 2;
+    }
+    --argc;
+  }
+  return test_eval(argc - 1, argv + 1);
+}
+
+/* Built-in coproc: a pool of long-lived workers that take requests over
+ * pipes instead of a fork and exec each.
+ *
+ *   coproc start N CMD [ARGS...]  start N copies of CMD
+ *   coproc send [ARGS...]         hand ARGS to the next idle worker
+ *   coproc wait                   collect every outstanding reply
+ *   coproc stop                   close the workers' input, reap them
+ *   coproc                        list the workers
+ *
+ * A request is one line on the worker's stdin, its arguments joined by
+ * tabs. The worker answers with one line on its stdout, "STATUS" or
+ * "STATUS\tPAYLOAD"; the payload is printed, and wait returns the
+ * highest status since the last wait.
+ */
+int
+builtin_coproc(int argc, char *argv[]) {
+  char const *sub = argc > 1 ? argv[1] : "";
+  if (argc == 1) {
+    for (size_t i = 0; i < n_workers; ++i) {
+      printf("[%zu] %jd %s\n", i, (intmax_t) workers[i].pid,
+             workers[i].busy ? "busy" : "idle");
+    }
+    fflush(stdout);
+    return EXIT_SUCCESS;
+  } else if (strcmp(sub, "start") == 0 && argc >= 4) {
+    char *end;
+    long n = strtol(argv[2], &end, 10);
+    if (*end == '\0' && n > 0) return coproc_start(n, argc - 3, argv + 3);
+  } else if (strcmp(sub, "send") == 0) {
+    return coproc_send(argc - 2, argv + 2);
+  } else if (strcmp(sub, "wait") == 0 && argc == 2) {
+    while (coproc_busy() > 0) coproc_collect();
+    int ret = coproc_status;
+    coproc_status = 0;
+    return ret;
+  } else if (strcmp(sub, "stop") == 0 && argc == 2) {
+    coproc_stop();
+    return EXIT_SUCCESS;
+  }
+  errno = EINVAL; // bad subcommand
+  fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+  return 2;
+}
+
+/* Starts n workers running the command in argv, each with a pipe to its
+ * stdin and one from its stdout. Any pool already running is stopped.
+ */
+int
+coproc_start(long n, int argc, char *argv[]) {
+  coproc_stop();
+  workers = calloc(n, sizeof *workers);
+  if (!workers) err(1, "calloc");
+
+  struct command cmd = { .argv = argv, .argc = argc };
+  for (long i = 0; i < n; ++i) {
+    int req[2], rep[2];
+    if (pipe2(req, O_CLOEXEC) == -1) goto fail;
+    if (pipe2(rep, O_CLOEXEC) == -1) {
+      close(req[0]);
+      close(req[1]);
+      goto fail;
+    }
+    pid_t pid = launch_command(&cmd, req[0], rep[1]);
+    close(req[0]);
+    close(rep[1]);
+    if (pid == -1) {
+      close(req[1]);
+      close(rep[0]);
+      coproc_stop();
+      return EXIT_FAILURE; // already reported
+    }
+    workers[n_workers++] = (struct worker) {
+      .pid = pid, .to_fd = req[1], .from_fd = rep[0],
+    };
+  }
+  dprintf("Started %zu workers running %s\n", n_workers, argv[0]);
+  return EXIT_SUCCESS;
+
+fail:
+  fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+  coproc_stop();
+  return EXIT_FAILURE;
+}
+
+/* Sends one request to an idle worker, first collecting replies until
+ * one is idle.
+ */
+int
+coproc_send(int argc, char *argv[]) {
+  struct worker *w;
+  for (;;) {
+    for (w = workers; w < workers + n_workers; ++w) {
+      if (!w->busy && w->to_fd != -1) break;
+    }
+    if (w < workers + n_workers) break;
+    if (coproc_busy() == 0) {
+      errno = ENOENT; // no pool, or every worker retired
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    coproc_collect();
+  }
+
+  // Request line: the arguments joined by tabs
+  size_t len = 1;
+  for (int i = 0; i < argc; ++i) len += strlen(argv[i]) + 1;
+  char *req = arena_alloc(&line_arena, len), *p = req;
+  for (int i = 0; i < argc; ++i) {
+    if (i > 0) *p++ = '\t';
+    p = stpcpy(p, argv[i]);
+  }
+  *p++ = '\n';
+
+  // A worker that died must not take the shell with it through SIGPIPE
+  struct sigaction ign = { .sa_handler = SIG_IGN }, old;
+  sigaction(SIGPIPE, &ign, &old);
+  ssize_t written = 0;
+  while (written < p - req) {
+    ssize_t ret = write(w->to_fd, req + written, (p - req) - written);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret == -1) break;
+    written += ret;
+  }
+  sigaction(SIGPIPE, &old, NULL);
+
+  if (written < p - req) {
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    coproc_retire(w);
+    return EXIT_FAILURE;
+  }
+  w->busy = true;
+  return EXIT_SUCCESS;
+}
+
+/* Counts the workers still working on a request */
+size_t
+coproc_busy(void) {
+  size_t n = 0;
+  for (size_t i = 0; i < n_workers; ++i) n += workers[i].busy;
+  return n;
+}
+
+/* Waits until at least one busy worker has replied, and handles every
+ * reply that has arrived: the payload goes to stdout and the status is
+ * folded into the next wait's.
+ */
+void
+coproc_collect(void) {
+  struct pollfd fds[n_workers];
+  size_t n_fds = 0;
+  for (size_t i = 0; i < n_workers; ++i) {
+    if (workers[i].busy) fds[n_fds++] = (struct pollfd) {
+      .fd = workers[i].from_fd, .events = POLLIN,
+    };
+  }
+  if (n_fds == 0) return;
+  if (poll(fds, n_fds, -1) == -1) {
+    if (errno != EINTR) {
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    }
+    return;
+  }
+
+  for (size_t i = 0, k = 0; i < n_workers; ++i) {
+    struct worker *w = &workers[i];
+    if (!w->busy || !(fds[k++].revents & (POLLIN | POLLHUP | POLLERR))) {
+      continue;
+    }
+    if (w->len == w->cap) {
+      w->cap = w->cap ? w->cap * 2 : 256;
+      w->buf = realloc(w->buf, w->cap);
+      if (!w->buf) err(1, "realloc");
+    }
+    ssize_t ret = read(w->from_fd, w->buf + w->len, w->cap - w->len);
+    if (ret <= 0) {
+      if (ret == -1 && errno == EINTR) continue;
+      errno = ret == 0 ? EPIPE : errno; // worker went away mid-request
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      if (coproc_status < 1) coproc_status = 1;
+      coproc_retire(w);
+      continue;
+    }
+    w->len += ret;
+
+    char *nl = memchr(w->buf, '\n', w->len);
+    if (!nl) continue;
+    *nl = '\0';
+    char *payload = strchr(w->buf, '\t');
+    if (payload) *payload++ = '\0';
+    int status = atoi(w->buf);
+    if (status > coproc_status) coproc_status = status;
+    if (payload) printf("%s\n", payload);
+
+    // Keep anything after the reply line
+    w->len -= nl + 1 - w->buf;
+    memmove(w->buf, nl + 1, w->len);
+    w->busy = false;
+  }
+  fflush(stdout);
+}
+
+/* Takes a worker that failed out of rotation */
+void
+coproc_retire(struct worker *w) {
+  w->busy = false;
+  if (w->to_fd != -1) close(w->to_fd);
+  w->to_fd = -1;
+}
+
+/* Sends every worker EOF, reaps them and frees the pool */
+void
+coproc_stop(void) {
+  for (size_t i = 0; i < n_workers; ++i) {
+    if (workers[i].to_fd != -1) close(workers[i].to_fd);
+    close(workers[i].from_fd);
+  }
+  for (size_t i = 0; i < n_workers; ++i) {
+    while (waitpid(workers[i].pid, NULL, 0) == -1 && errno == EINTR);
+    free(workers[i].buf);
+  }
+  free(workers);
+  workers = NULL;
+  n_workers = 0;
+}
+
+/* Built-in memo: memo CMD [ARGS...] runs CMD through the cache. The key
+ * is a hash of the working directory, the arguments and, when stdin is
+ * a regular file (a '<' redirection), its inode, size and mtime. A hit
+ * replays the stored stdout and exit status without running anything; a
+ * miss runs CMD as usual, passes its output on and stores it. CMD's
+ * stderr is never cached, and neither is a run killed by a signal. Only
+ * a regular file or /dev/null on stdin can be keyed; with anything else
+ * (a pipe, a terminal, a socket) CMD just runs uncached.
+ *
+ * Entries live in the cache directory as memo/KEY: a header with the
+ * status, followed by the output.
+ */
+int
+builtin_memo(int argc, char *argv[]) {
+  if (argc < 2) {
+    errno = EINVAL; // no command
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    return 2;
+  }
+  struct command cmd = { .argv = argv + 1, .argc = argc - 1 };
+
+  // Key: cwd, argv, and which input file in which version
+  struct stat st, null_st;
+  bool keyed = fstat(STDIN_FILENO, &st) == 0
+            && (S_ISREG(st.st_mode)
+            || (S_ISCHR(st.st_mode) && stat("/dev/null", &null_st) == 0
+            && st.st_rdev == null_st.st_rdev));
+  char *cwd = getcwd(NULL, 0);
+  uint64_t key = fnv1a64(MEMO_MAGIC, sizeof MEMO_MAGIC);
+  if (cwd) key ^= fnv1a64(cwd, strlen(cwd) + 1) * 3;
+  free(cwd);
+  for (int i = 1; i < argc; ++i) {
+    key = (key ^ fnv1a64(argv[i], strlen(argv[i]) + 1)) * 1099511628211u;
+  }
+  if (keyed && S_ISREG(st.st_mode)) { // /dev/null needs no more
+    int64_t id[] = { st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec,
+                     st.st_mtim.tv_nsec };
+    key ^= fnv1a64(id, sizeof id);
+  }
+  char *path = keyed ? cache_path("memo/%016jx", (uintmax_t) key) : NULL;
+  if (!path) {
+    int status = memo_run(&cmd, -1);
+    return status < 0 ? EXIT_FAILURE : status;
+  }
+
+  // Hit: replay it
+  struct memo_header hdr;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd != -1) {
+    if (read(fd, &hdr, sizeof hdr) == sizeof hdr
+    && memcmp(hdr.magic, MEMO_MAGIC, sizeof hdr.magic) == 0) {
+      dprintf("memo hit %s\n", path);
+      int status = hdr.status;
+      if (copy_fd(fd, STDOUT_FILENO) == -1) {
+        // part of it may be out already, so don't run it again
+        fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+        status = EXIT_FAILURE;
+      }
+      close(fd);
+      free(path);
+      return status;
+    }
+    close(fd);
+  }
+
+  // Miss: run it into a new entry, then pass that on
+  char *tmp = NULL;
+  if (asprintf(&tmp, "%s.%jd", path, (intmax_t) getpid()) == -1) tmp = NULL;
+  fd = tmp ? open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+  if (fd == -1 && tmp && errno == ENOENT && mkdir_parents(tmp) == 0) {
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  }
+  hdr = (struct memo_header) { .magic = MEMO_MAGIC, .status = -1 };
+  if (fd == -1 || write(fd, &hdr, sizeof hdr) != sizeof hdr) {
+    // nowhere to store it, just run it
+    if (fd != -1) close(fd);
+    if (tmp) unlink(tmp);
+    free(tmp);
+    free(path);
+    int status = memo_run(&cmd, -1);
+    return status < 0 ? EXIT_FAILURE : status;
+  }
+
+  int status = memo_run(&cmd, fd);
+  bool ok = status >= 0 && status < 128; // exited, not signaled
+  hdr.status = status;
+  if (lseek(fd, sizeof hdr, SEEK_SET) == -1
+  || copy_fd(fd, STDOUT_FILENO) == -1) {
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    ok = false;
+  }
+  if (ok && pwrite(fd, &hdr, sizeof hdr, 0) != sizeof hdr) ok = false;
+  if (close(fd) == -1) ok = false;
+  if (!ok || rename(tmp, path) == -1) unlink(tmp);
+  dprintf("memo miss %s: %s\n", path, ok ? "stored" : "not stored");
+  free(tmp);
+  free(path);
+  return status < 0 ? EXIT_FAILURE : status;
+}
+
+/* Runs a command for memo with its stdout on out_fd (-1 to inherit) and
+ * waits for it. Returns its $? value, or -1 if it could not be run.
+ */
+int
+memo_run(struct command const *cmd, int out_fd) {
+  pid_t pid = launch_command(cmd, -1, out_fd);
+  if (pid == -1) return -1;
+
+  int status;
+  struct rusage ru;
+  while (wait4(pid, &status, 0, &ru) == -1) {
+    if (errno != EINTR) {
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      return -1;
+    }
+  }
+  usage_add(&line_usage, &ru);
+  return wait_status(status);
+}
+
+/* Starts the command at path with posix_spawn(), its stdin and stdout
+ * dup2'ed from the fd plan, the only file actions left. SIGINT and
+ * SIGTSTP are reset to their
+ * dispositions from before the shell changed them. An ignored signal
+ * stays ignored across exec, so only the ones that were not ignored need
+ * to go in the default set.
+ *
+ * Returns the child pid, or -1 with errno set if the spawn failed.
+ */
+pid_t
+spawn_command(char const *path, char *const argv[],
+              struct fd_plan const *plan) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t sigdefault, sigmask;
+  pid_t pid = -1;
+  int ret;
+
+  if ((ret = posix_spawn_file_actions_init(&actions)) != 0) {
+    errno = ret;
+    return -1;
+  }
+  if ((ret = posix_spawnattr_init(&attr)) != 0) {
+    posix_spawn_file_actions_destroy(&actions);
+    errno = ret;
+    return -1;
+  }
+
+  // Connect pipes and redirections
+  if (plan->in != -1) {
+    ret = posix_spawn_file_actions_adddup2(&actions, plan->in, STDIN_FILENO);
+    if (ret != 0) goto done;
+  }
+  if (plan->out != -1) {
+    ret = posix_spawn_file_actions_adddup2(&actions, plan->out, STDOUT_FILENO);
+    if (ret != 0) goto done;
+  }
+
+  // Reset signals
+  sigemptyset(&sigdefault);
+  if (sigint_old.sa_handler != SIG_IGN) sigaddset(&sigdefault, SIGINT);
+  if (sigtstp_old.sa_handler != SIG_IGN) sigaddset(&sigdefault, SIGTSTP);
+  sigemptyset(&sigmask);
+  if ((ret = posix_spawnattr_setsigdefault(&attr, &sigdefault)) != 0
+  || (ret = posix_spawnattr_setsigmask(&attr, &sigmask)) != 0
+  || (ret = posix_spawnattr_setflags(&attr, 
+                                     POSIX_SPAWN_SETSIGDEF 
+                                     | POSIX_SPAWN_SETSIGMASK)) != 0) {
+    goto done;
+  }
+
+  // Execute command
+  ret = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+  if (ret == 0) {
+    dprintf("Child #%jd spawned.\n", (intmax_t) pid);
+  }
+
+done:
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  if (ret != 0) {
+    errno = ret;
+    return -1;
+  }
+  return pid;
+}
+
+/* Starts one command as a child process with its stdin/stdout connected
+ * to in_fd/out_fd (-1 to inherit), or to its redirections, which are
+ * opened here in the parent, once. External commands are spawned; pure
+ * built-ins, and anything with a placement to apply, run in a fork()ed
+ * copy of the shell, which then execs the command if it is external.
+ *
+ * Returns the child pid, or -1 after reporting the error.
+ */
+pid_t
+launch_command(struct command const *cmd, int in_fd, int out_fd) {
+  pid_t fork_pid = -13; // set to bogus numbers in case of bad luck
+
+  // Pure built-ins run in a forked copy of the shell
+  struct builtin const *bi = builtin_find(cmd->argv[0]);
+  if (bi && !bi->pure) bi = NULL;
+
+  // Redirections are opened even if the command turns out not to exist
+  struct fd_plan plan;
+  if (!fd_plan_open(&plan, cmd, in_fd, out_fd)) return -1;
+
+  // Resolve command through the hash table
+  char *cmd_path = bi ? NULL : hash_lookup(cmd->argv[0]);
+  if (!bi && cmd_path == NULL) {
+    dprintf("Command \"%s\" not found.\n", cmd->argv[0]);
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    fd_plan_close(&plan);
+    return -1;
+  }
+
+  if (!bi && !placement) {
+    // Spawn without copying the shell's page tables
+    uint64_t t0 = trace_now();
+    fork_pid = spawn_command(cmd_path, cmd->argv, &plan);
+    trace_span(TRACE_EXEC, t0); // posix_spawn returns once the exec is done
+    if (fork_pid == -1) {
+      dprintf("posix_spawn failed.\n");
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+    }
+    fd_plan_close(&plan);
+    return fork_pid;
+  }
+
+  // Built-in or placed job: set the child up by hand
+  fflush(stdout); // or the child would print it again
+  uint64_t t0 = trace_now();
+  fork_pid = fork();
+  if (fork_pid != 0) trace_span(TRACE_FORK, t0);
+
+  if (fork_pid == -1) {
+    // fork failed
+    fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+  } else if (fork_pid == 0) {
+    // Child Process
+
+    // Reset signals
+    if (sigaction(SIGINT, &sigint_old, NULL) == -1 
+    || sigaction(SIGTSTP, &sigtstp_old, NULL) == -1) {
+      dprintf("Signal restoration failed");
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    // Connect pipes and redirections
+    fd_plan_apply(&plan);
+    if (placement && !placement_apply(placement)) _exit(EXIT_FAILURE);
+
+    if (!bi) {
+      execv(cmd_path, cmd->argv);
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      _exit(EXIT_FAILURE);
+    }
+
+    // Run the built-in
+    int status = bi->fn(cmd->argc, cmd->argv);
+    fflush(stdout);
+    _exit(status);
+  }
+  fd_plan_close(&plan);
+  return fork_pid;
+}
+
+/* Starts every stage of a pipeline before waiting on any of them, so the
+ * stages run concurrently. Each stage's stdout is connected to the next
+ * stage's stdin through a close-on-exec pipe, and the last one's to
+ * out_fd (-1 to inherit); a child only keeps the ends that were dup2'ed
+ * onto its stdin/stdout.
+ *
+ * Fills pids[] with each stage's pid, or -1 for a stage that failed to
+ * start. Returns the number of stages started.
+ */
+size_t
+launch_pipeline(struct command const *cmds, size_t n_cmds, pid_t pids[],
+                int out_fd) {
+  size_t n_started = 0;
+  int in_fd = -1;
+
+  for (size_t i = 0; i < n_cmds; ++i) {
+    int pipe_fds[2] = {-1, -1};
+    if (i + 1 < n_cmds && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+      fprintf(stderr, "Error No. %d: %s\n", errno, strerror(errno));
+      for (; i < n_cmds; ++i) pids[i] = -1;
+      break;
+    }
+
+    int out = i + 1 < n_cmds ? pipe_fds[1] : out_fd;
+    pids[i] = launch_command(&cmds[i], in_fd, out);
+    if (pids[i] != -1) ++n_started;
+
+    // The children hold their own copies now
+    if (in_fd != -1) close(in_fd);
+    if (pipe_fds[1] != -1) close(pipe_fds[1]);
+    in_fd = pipe_fds[0];
+  }
+  if (in_fd != -1) close(in_fd);
+  return n_started;
+}